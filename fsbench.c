@@ -0,0 +1,211 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "troydm" Geurkov (d.geurkov@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define null 0
+
+#define CACHE_LINE_SIZE 64
+
+// threads write at the same time and don't exit until all of them are done
+static pthread_barrier_t barrier;
+
+// objects of every thread and the line sharing check
+typedef struct {
+    uint32_t id;
+    uint32_t count; // objects per thread
+    uint32_t iterations; // writes to every object
+    size_t size; // object size
+    void** objects;
+} bench_thread;
+
+// cache line touched by object and thread that owns it
+typedef struct {
+    uintptr_t line;
+    uint32_t thread;
+} line_owner;
+
+// time in milliseconds since 1970 jan 1 00:00
+static uint64_t get_time(){
+    struct timeval t;
+    gettimeofday(&t,null);
+    return ((uint64_t)t.tv_sec)*1000 + t.tv_usec/1000;
+}
+
+// write first and last byte of every object of the thread
+static void write_objects(bench_thread* bt){
+    pthread_barrier_wait(&barrier);
+    for(uint32_t i = 0; i < bt->iterations; ++i){
+        for(uint32_t k = 0; k < bt->count; ++k){
+            volatile uint8_t* o = (volatile uint8_t*)bt->objects[k];
+            ++o[0];
+            ++o[bt->size-1];
+        }
+    }
+    pthread_barrier_wait(&barrier);
+}
+
+// active false sharing, every thread allocates its own objects and writes to them
+static void* active_thread(void* v){
+    bench_thread* bt = (bench_thread*)v;
+    for(uint32_t k = 0; k < bt->count; ++k)
+        bt->objects[k] = malloc(bt->size);
+    write_objects(bt);
+    return null;
+}
+
+// passive false sharing, objects allocated by main thread are freed by every thread
+// and allocated again, allocator might give back objects sharing line with other threads
+static void* passive_thread(void* v){
+    bench_thread* bt = (bench_thread*)v;
+    for(uint32_t k = 0; k < bt->count; ++k)
+        free(bt->objects[k]);
+    for(uint32_t k = 0; k < bt->count; ++k)
+        bt->objects[k] = malloc(bt->size);
+    write_objects(bt);
+    return null;
+}
+
+static int line_compare(const void* a, const void* b){
+    uintptr_t la = ((const line_owner*)a)->line;
+    uintptr_t lb = ((const line_owner*)b)->line;
+    return la < lb ? -1 : la > lb;
+}
+
+// count cache lines that have objects of more than one thread
+static uint32_t shared_lines(bench_thread* bts, uint32_t threads, uint32_t* lines){
+    uint32_t n = 0;
+    line_owner* lo = malloc(sizeof(line_owner)*threads*bts[0].count*2);
+    for(uint32_t t = 0; t < threads; ++t){
+        for(uint32_t k = 0; k < bts[t].count; ++k){
+            uintptr_t o = (uintptr_t)bts[t].objects[k];
+            lo[n].line = o/CACHE_LINE_SIZE;
+            lo[n++].thread = t;
+            // lines between first and last one belong to the object only
+            lo[n].line = (o+bts[t].size-1)/CACHE_LINE_SIZE;
+            lo[n++].thread = t;
+        }
+    }
+    qsort(lo,n,sizeof(line_owner),line_compare);
+    uint32_t shared = 0;
+    *lines = 0;
+    for(uint32_t i = 0; i < n;){
+        uint32_t j = i+1;
+        bool other = false;
+        for(; j < n && lo[j].line == lo[i].line; ++j)
+            other |= lo[j].thread != lo[i].thread;
+        if(other)
+            ++shared;
+        ++*lines;
+        i = j;
+    }
+    free(lo);
+    return shared;
+}
+
+// run threads and report time and cache lines shared between threads
+static void bench(const char* name, void* (*f)(void*), bench_thread* bts, uint32_t threads){
+    pthread_t* pts = malloc(sizeof(pthread_t)*threads);
+    pthread_barrier_init(&barrier,null,threads);
+    uint64_t t = get_time();
+    for(uint32_t i = 0; i < threads; ++i){
+        if(pthread_create(&(pts[i]),null,f,&(bts[i])) != 0){
+            fprintf(stderr, "can't create thread\n");
+            exit(1);
+        }
+    }
+    for(uint32_t i = 0; i < threads; ++i)
+        pthread_join(pts[i],null);
+    t = get_time()-t;
+    pthread_barrier_destroy(&barrier);
+    uint32_t lines;
+    uint32_t shared = shared_lines(bts,threads,&lines);
+    printf("%s false sharing took %lums, %u of %u cache lines shared between threads\n",name,t,shared,lines);
+    for(uint32_t i = 0; i < threads; ++i){
+        for(uint32_t k = 0; k < bts[i].count; ++k)
+            free(bts[i].objects[k]);
+    }
+    free(pts);
+}
+
+int main(int argc, char* argv[]){
+    uint32_t threads = 4;
+    uint32_t count = 64;
+    uint32_t iterations = 100000;
+    size_t size = 8;
+
+    int c;
+    while((c = getopt(argc,argv,"t:n:i:s:h")) != -1){
+        switch(c){
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'i':
+                iterations = atoi(optarg);
+                break;
+            case 's':
+                size = atoi(optarg);
+                break;
+            default:
+                printf("./fsbench [-t 4] [-n 64] [-i 100000] [-s 8] - small object false sharing benchmark\n");
+                return 1;
+        }
+    }
+    if(threads == 0 || count == 0 || size == 0){
+        fprintf(stderr, "threads, objects and size can't be 0\n");
+        return 1;
+    }
+
+    bench_thread* bts = malloc(sizeof(bench_thread)*threads);
+    for(uint32_t i = 0; i < threads; ++i){
+        bts[i].id = i;
+        bts[i].count = count;
+        bts[i].iterations = iterations;
+        bts[i].size = size;
+        bts[i].objects = malloc(sizeof(void*)*count);
+    }
+
+    bench("active",active_thread,bts,threads);
+
+    // objects handed to threads are allocated one after another by main thread
+    for(uint32_t k = 0; k < count; ++k){
+        for(uint32_t i = 0; i < threads; ++i)
+            bts[i].objects[k] = malloc(size);
+    }
+    bench("passive",passive_thread,bts,threads);
+
+    for(uint32_t i = 0; i < threads; ++i)
+        free(bts[i].objects);
+    free(bts);
+    return 0;
+}
@@ -28,72 +28,294 @@ THE SOFTWARE.
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
 #include <mymalloc.h>
 #include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
 #include <sys/mman.h>
 #include <linux/mman.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 // for code clarity for pointers we use null instead of 0
 #define null 0
 
 // initial values
 #define PAGE_SIZE (sysconf(_SC_PAGESIZE))
-#define MIN_BLOCK_SIZE 32 // bytes
-#define ALLOC_SIZE 33554432 // 32 MiB or 8192 pages if page size is 4096
-#define GIVE_BACK_SIZE 33554432 // 32 MiB or 8192 pages if page size is 4096
-#define MMAP_SIZE 1048576 // 1 MiB or 1024 pages if page size is 4096
+#define MIN_BLOCK_SIZE 48 // bytes
+#define CHUNK_SIZE 33554432 // 32 MiB, heap chunk size, power of 2 at least twice MMAP_THRESHOLD_MAX
+#define HEAP_RESERVE_SIZE 4398046511104 // 4 TiB of address space reserved for heap chunks, heap can't grow past it
+/* #define HEAP_HUGEPAGE 1 */ // ask for heap chunks and slab region to be backed by transparent huge pages
+#define HUGE_PAGE_SIZE 2097152 // 2 MiB, chunks and slab region are aligned to it
+#define MMAP_SIZE 1048576 // 1 MiB or 1024 pages if page size is 4096, initial mmap threshold
+#define MMAP_THRESHOLD_MAX 16777216 // 16 MiB, mmap threshold rises up to this as mmap blocks are freed
+#define MMAP_CACHE_SIZE 134217728 // 128 MiB, released mmap blocks kept mapped for reuse
+#define MMAP_CACHE_DEPTH 4 // released mmap blocks of a single size class kept mapped
+/* #define BACKGROUND_THREAD 1 */ // unmap, purge and merge in a background thread instead of freeing threads
+#define BACKGROUND_PENDING 268435456 // 256 MiB, queued for background thread before freeing threads unmap themselves
+#define PURGE_DECAY_TIME 10000000000 // ns, pages of free blocks are given back gradually over this time
+#define PURGE_STEPS 10 // decay steps, free pages are checked once per step
+/* #define PURGE_LAZY 1 */ // purge with MADV_FREE so kernel takes pages only under memory pressure
 #define MERGE_ADJ_ON_REALLOC 1 // try to merge with adjacent blocks on realloc
+#define SLAB_SIZE 4096 // bytes, each slab holds objects of a single size class
+#define SLAB_MAX_SIZE 1024 // bytes, sizes up to this are allocated from slabs
+#define SLAB_REGION_SIZE 1073741824 // 1 GiB of address space reserved for slabs
+#define LOCK_SPIN 100 // times busy lock is checked before waiting thread goes to sleep
+/* #define LOCK_STATS 1 */ // count lock acquisitions and time spent waiting for lock
+#define FREE_STACK_DEPTH 128 // freed objects of a single slab size class kept in lock free stack
+#define QUICK_MAX_SIZE 16384 // bytes, freed blocks up to this size are kept in quick lists unmerged
+#define INDEX_INIT_SIZE 512 // free blocks, initial capacity of freelist index
+
+// tunables
+// initial values above are defaults that can be changed at run time, they are read once
+// on first use from MYMALLOC_CONF environment variable as comma separated key:value
+// pairs, e.g. MYMALLOC_CONF=mmap_threshold:4194304,decay_ms:1000. keys are
+// min_block_size, mmap_threshold, mmap_threshold_max, mmap_cache_size, decay_ms and
+// merge_adj_on_realloc, unknown ones are ignored. mallopt can change some of them later.
+// mmap threshold is adjusted when a request misses mmap cache while a block of its size
+// class was unmapped within decay time, the threshold rises past it so that blocks of that
+// size allocated and freed repeatedly are cut from heap instead of being mapped and unmapped
+// every time. setting mmap_threshold in either way turns adjustment off
+static size_t min_block_size = MIN_BLOCK_SIZE;
+static size_t mmap_threshold = MMAP_SIZE;
+static size_t mmap_threshold_max = MMAP_THRESHOLD_MAX;
+static bool mmap_threshold_fixed = false; // threshold was set explicitly and isn't adjusted
+static size_t mmap_cache_max = MMAP_CACHE_SIZE;
+static uint64_t purge_decay_time = PURGE_DECAY_TIME;
+#ifdef MERGE_ADJ_ON_REALLOC
+static bool merge_adj_on_realloc = true;
+#else
+static bool merge_adj_on_realloc = false;
+#endif
+static bool conf_ready = false;
 
 // memory block structure
 typedef struct memory_block_t {
     size_t size;
     struct memory_block_t* prev;
     struct memory_block_t* next;
+    size_t slot; // position of free block in freelist index
+    uint64_t stamp; // time free block was last freed, 0 once its pages are purged
 } memory_block;
 
+// block flags kept in lower bits of size
+// free blocks also keep their size in the last size_t of the block (footer)
+// so that left adjacent free block can be found without walking freelist
+#define BLOCK_FREE 1 // block is free
+#define BLOCK_PREV_FREE 2 // left adjacent block is free
+#define BLOCK_FLAGS (BLOCK_FREE|BLOCK_PREV_FREE)
+
 // free memory block list
 static memory_block freelist[] = { { 0, null, &(freelist[1]) },  { 0, &(freelist[0]), null} };
 #define freelist_start (freelist[0].next)
 #define freelist_begin (&(freelist[0]))
 #define freelist_end (&(freelist[1]))
 
+// freelist index
+// sizes and addresses of free blocks are also kept in contiguous arrays so that freelist
+// can be searched with vector instructions without touching the blocks themselves.
+// blocks are appended in the order they are added to freelist and removed ones leave
+// a hole of size 0 until index is compacted, search goes from the end so it finds
+// the same block as walking freelist from its start would
+#define INDEX_NONE ((size_t)-1) // block is not in freelist index
+typedef struct {
+    size_t* sizes;
+    memory_block** blocks;
+    size_t count; // slots in use including holes
+    size_t holes;
+    size_t capacity;
+} block_index;
+static block_index freelist_index;
+
 // heap
-static memory_block* heap_start = null;
-static memory_block* heap_end = null;
-static uint32_t heap_size;
-static uint32_t mmap_size;
+// heap is a set of chunks allocated with mmap and aligned to CHUNK_SIZE. every chunk ends
+// with a fence, header of a used block of size 0, so that blocks never merge across chunks
+// and the right adjacent block of any heap block is always a valid block header.
+// current chunk ends with top block that is never in freelist, fresh memory is cut from
+// its start and blocks freed next to it are merged back into it. top block might be empty
+// in which case fence is its header. chunk that becomes a single free block is unmapped
+static memory_block* heap_end = null; // fence of current chunk
+static memory_block* heap_top = null;
+static size_t heap_size; // bytes in chunks
+static size_t mmap_size; // bytes in mmap blocks in use
+static uint64_t heap_top_stamp = 0; // time block was last merged into top block, 0 once its pages are purged
+
+// heap reservation
+// chunks are committed from a single range of address space reserved on first use so that
+// heap pointers are classified with a range check. chunks given back are decommitted and
+// their slots are reused before the rest of the reservation
+#define HEAP_RESERVE_WORDS ((HEAP_RESERVE_SIZE/CHUNK_SIZE + 63)/64)
+static uint8_t* heap_reserve_start = null;
+static uint8_t* heap_reserve_end = null;
+static uint8_t* heap_reserve_top = null; // first never committed chunk slot
+static uint64_t heap_reserve_free[HEAP_RESERVE_WORDS]; // bitmap of decommitted chunk slots
+#define heap_contains(p) ((uint8_t*)(p) >= heap_reserve_start && (uint8_t*)(p) < heap_reserve_end)
+
+// page map
+// radix tree from page number to what the page is used for so that any pointer given
+// to free or realloc is classified without touching the memory it points to.
+// 48 bit address space of 4 KiB pages is split into 3 levels of 12 bits, nodes are
+// allocated with mmap when pages under them are first used
+#define PAGE_MAP_SHIFT 12 // log2 of page size tracked by page map
+#define PAGE_MAP_BITS 12 // bits of page number for every level
+#define PAGE_MAP_LEN (1UL << PAGE_MAP_BITS)
+#define PAGE_MAP_MASK (PAGE_MAP_LEN - 1)
+#define PAGE_MAP_PAGE (1UL << PAGE_MAP_SHIFT)
+#define PAGE_NONE 0 // page isn't ours
+#define PAGE_HEAP 1 // page of heap chunk, found by range check and never set in page map
+#define PAGE_MMAP 2 // first page of mmap block
+#define PAGE_SLAB 3 // slab page, size class of the slab is added to it
+typedef uint8_t page_map_leaf[PAGE_MAP_LEN];
+typedef page_map_leaf* page_map_node[PAGE_MAP_LEN];
+static page_map_node* page_map[PAGE_MAP_LEN];
+
+// slab structure
+// small objects have no header, slabs are carved from a reserved region
+// and slab of an object is found from object address
+typedef struct slab_t {
+    struct slab_t* prev;
+    struct slab_t* next;
+    void* free; // freed objects list
+    uint32_t top; // offset of first never used object
+    uint32_t used; // objects in use
+    uint32_t size; // object size
+} slab;
+
+#define SLAB_CLASS_COUNT 20 // size classes up to SLAB_MAX_SIZE
+
+// slabs
+static uint8_t* slab_region_start = null;
+static uint8_t* slab_region_end = null;
+static uint8_t* slab_region_top = null;
+static slab* slabs = null; // slab descriptors, one for every SLAB_SIZE of region
+static slab* slab_empty = null; // empty slabs that can be reused by any size class
+static slab* slab_partial[SLAB_CLASS_COUNT]; // slabs with free objects
+static uint32_t slab_count[SLAB_CLASS_COUNT];
+static uint32_t slab_used[SLAB_CLASS_COUNT];
+
+#define ptr_slab(p) (&(slabs[(byte_ptr(p) - slab_region_start)/SLAB_SIZE]))
+#define slab_start(sl) (slab_region_start + (sl - slabs)*SLAB_SIZE)
+#define slab_full(sl) (sl->free == null && sl->top + sl->size > SLAB_SIZE)
 
-// mmap
-#define is_mmap_block(b) (!(heap_start <= b && b < heap_end))
+// free stacks
+// freed slab objects are kept in lock free Treiber stacks per size class so that small
+// objects are allocated and freed without waiting for a lock holder. top of the stack,
+// a tag that changes on every push and pop and object count are swapped together with
+// double width CAS so that pop with stale next pointer can't succeed (ABA). objects in
+// stacks are still counted as used by their slabs and slab memory is never unmapped so
+// next pointer of an object can always be read even if it was popped meanwhile
+typedef union {
+    struct {
+        void* top;
+        uint32_t tag;
+        uint32_t count;
+    };
+    unsigned __int128 word;
+} __attribute__((aligned(16))) free_stack_head;
+typedef struct {
+    free_stack_head head;
+} __attribute__((aligned(64))) free_stack;
+static free_stack free_stacks[SLAB_CLASS_COUNT];
+
+// double width CAS needs cmpxchg16b on x86
+#if defined(__x86_64__)
+#define FREE_STACK_CAS __attribute__((target("cx16")))
+#else
+#define FREE_STACK_CAS
+#endif
+
+// quick lists
+// freed blocks that are small enough are pushed to the quick list of their size class
+// without merging, they stay marked as used so adjacent blocks don't merge with them.
+// quick lists are merged into freelist in one go when malloc can't find a block or heap is trimmed
+#define QUICK_CLASS_COUNT 36 // size classes up to QUICK_MAX_SIZE
+static memory_block* quick_lists[QUICK_CLASS_COUNT];
+static size_t quick_size; // bytes held in quick lists
 
 // locking
-volatile bool locked = 0;
-
-static inline void spinlock(){
-    if (!__sync_bool_compare_and_swap(&locked, 0, 1)){
-        int i = 0;
-        do {
-            if (__sync_bool_compare_and_swap(&locked, 0, 1))
-                break;
-            else{
-                if(i == 10){
-                    i = 0;
-                    sched_yield();
-                }else
-                    ++i;
-            }
-        } while (1);
+// adaptive lock word is 0 when unlocked, 1 when locked and 2 when locked and some thread
+// might be sleeping on it. waiter spins reading the word for a short while before trying
+// to take it again and then sleeps on futex until unlock wakes it up
+typedef struct {
+    volatile uint32_t word;
+#ifdef LOCK_STATS
+    // updated by lock holder
+    uint64_t acquired; // times lock was taken
+    uint64_t contended; // times lock was taken after waiting for it
+    uint64_t wait_time; // total time spent waiting in ns
+#endif
+} alock;
+static alock heap_lock;
+
+#if defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
+#define futex_wait(w,v) syscall(SYS_futex,w,FUTEX_WAIT_PRIVATE,v,null,null,0)
+#define futex_wake(w,n) syscall(SYS_futex,w,FUTEX_WAKE_PRIVATE,n,null,null,0)
+
+#ifdef LOCK_STATS
+static inline uint64_t lock_clock(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000UL + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+// wait for lock held by another thread
+static void lock_wait(alock* l){
+#ifdef LOCK_STATS
+    uint64_t t = lock_clock();
+#endif
+    uint32_t w = 0;
+    for(int i = 0; i < LOCK_SPIN; ++i){
+        cpu_relax();
+        w = l->word;
+        if(w == 0 && __sync_bool_compare_and_swap(&(l->word),0,1))
+            goto locked;
+        // someone is already sleeping so there is no point to keep spinning
+        if(w == 2)
+            break;
     }
+    // mark lock as having sleepers, if it was unlocked meanwhile we own it
+    while(__atomic_exchange_n(&(l->word),2,__ATOMIC_ACQUIRE) != 0)
+        futex_wait(&(l->word),2);
+locked:
+#ifdef LOCK_STATS
+    ++l->contended;
+    l->wait_time += lock_clock() - t;
+#endif
+    return;
+}
+
+static inline void adaptive_lock(alock* l){
+    if(l->word != 0 || !__sync_bool_compare_and_swap(&(l->word),0,1))
+        lock_wait(l);
+#ifdef LOCK_STATS
+    ++l->acquired;
+#endif
+}
+
+static inline void adaptive_unlock(alock* l){
+    // only wake up sleepers if there might be any
+    if(__atomic_exchange_n(&(l->word),0,__ATOMIC_RELEASE) == 2)
+        futex_wake(&(l->word),1);
 }
 
-#define lock spinlock();
+#define lock adaptive_lock(&heap_lock);
 
-#define unlock \
-    __asm__ __volatile__ ("" ::: "memory"); \
-    locked = 0;
+#define unlock adaptive_unlock(&heap_lock);
 
 // uncomment for debug use only
 /* #define lock */
@@ -105,7 +327,19 @@ static inline void spinlock(){
 #define shift_block_ptr(b,s) ((memory_block*)(shift_ptr(b,s)))
 #define block_data(b) (shift_ptr(b,+sizeof(size_t)))
 #define data_block(p) (shift_block_ptr(p,-sizeof(size_t)))
-#define block_end(b) (shift_block_ptr(b,+b->size))
+#define block_size(b) (b->size & ~BLOCK_FLAGS)
+#define block_end(b) (shift_block_ptr(b,+block_size(b)))
+#define block_footer(b) (*((size_t*)shift_ptr(b,+block_size(b)-sizeof(size_t))))
+#define block_left(b) (shift_block_ptr(b,-*((size_t*)shift_ptr(b,-sizeof(size_t)))))
+#define heap_top_size ((size_t)(byte_ptr(heap_end) - byte_ptr(heap_top)))
+#define chunk_start(b) ((memory_block*)((uintptr_t)(b) & ~((uintptr_t)CHUNK_SIZE - 1)))
+#define chunk_fence(c) (shift_block_ptr(c,+(CHUNK_SIZE - sizeof(size_t))))
+#define chunk_free(b) (b == chunk_start(b) && block_size(b) == CHUNK_SIZE - sizeof(size_t))
+
+// move start of top block to b
+#define heap_top_move(b) \
+    heap_top = b; \
+    heap_top->size = heap_top_size;
 
 #define block_link(lb,rb) \
     rb->prev = lb; \
@@ -135,116 +369,1042 @@ static inline void print_block(memory_block* b){
     printf("block %p size %ld prev %p next %p\n",b,b->size,b->prev,b->next);
 }
 
-// add block to free list
-static inline void add_block(memory_block* block){
-    if(freelist_start != freelist_end){
-        // find superseding memory block
-        // and insert current one before it
-        memory_block* b = freelist_start;
-        while(1){
-            // superseding memory block will have higher memory address
-            if(b > block){
-                block_link_left(block,b);
-                break;
-            }
-            // check if we hit end
-            if(b->next == freelist_end){
-                block_link_right(b,block);
-                break;
-            }else{
-                b = b->next;
-            }
+// get page map entry of page containing p
+static inline uint8_t page_map_get(void* p){
+    uintptr_t n = (uintptr_t)p >> PAGE_MAP_SHIFT;
+    if(n >> (3*PAGE_MAP_BITS))
+        return PAGE_NONE;
+    page_map_node* node = page_map[n >> (2*PAGE_MAP_BITS)];
+    if(node == null)
+        return PAGE_NONE;
+    page_map_leaf* leaf = (*node)[(n >> PAGE_MAP_BITS) & PAGE_MAP_MASK];
+    if(leaf == null)
+        return PAGE_NONE;
+    return (*leaf)[n & PAGE_MAP_MASK];
+}
+
+// set page map entry of every page overlapping s bytes at p to v
+static inline bool page_map_set(void* p, size_t s, uint8_t v){
+    uintptr_t n = (uintptr_t)p >> PAGE_MAP_SHIFT;
+    uintptr_t e = ((uintptr_t)p + s - 1) >> PAGE_MAP_SHIFT;
+    if(e >> (3*PAGE_MAP_BITS))
+        return false;
+    while(n <= e){
+        page_map_node** node = &(page_map[n >> (2*PAGE_MAP_BITS)]);
+        if(*node == null){
+            void* m = mmap(NULL,sizeof(page_map_node),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+            if(m == MAP_FAILED)
+                return false;
+            *node = (page_map_node*)m;
         }
+        page_map_leaf** leaf = &((**node)[(n >> PAGE_MAP_BITS) & PAGE_MAP_MASK]);
+        if(*leaf == null){
+            void* m = mmap(NULL,sizeof(page_map_leaf),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+            if(m == MAP_FAILED)
+                return false;
+            *leaf = (page_map_leaf*)m;
+        }
+        // pages up to the end of this leaf are set at once
+        uintptr_t le = n | PAGE_MAP_MASK;
+        if(le > e)
+            le = e;
+        memset(&((**leaf)[n & PAGE_MAP_MASK]),v,le - n + 1);
+        n = le + 1;
+    }
+    return true;
+}
 
-        // merge adjacent blocks
-        bool merged = true;
-        while(merged){
-            // merge right adjacent block
-            if(block_end(block) == block->next){
-                block->size += block->next->size;
-                block_unlink_right(block);
-                continue;
-            }
-            // merge left adjacent block
-            if(block_end(block->prev) == block){
-                block = block->prev;
-                block->size += block->next->size;
-                block_unlink_right(block);
-                continue;
+// make room for one more block in freelist index
+// holes are squeezed out if there are enough of them otherwise index is grown
+static inline bool index_reserve(block_index* ix){
+    if(ix->count < ix->capacity)
+        return true;
+    if(ix->holes > 0 && ix->holes >= ix->count/4){
+        size_t j = 0;
+        for(size_t i = 0; i < ix->count; ++i){
+            if(ix->sizes[i] != 0){
+                ix->sizes[j] = ix->sizes[i];
+                ix->blocks[j] = ix->blocks[i];
+                ix->blocks[j]->slot = j;
+                ++j;
             }
-            merged = false;
+        }
+        ix->count = j;
+        ix->holes = 0;
+        return true;
+    }
+    // sizes and addresses share one mapping, addresses follow sizes
+    size_t capacity = ix->capacity == 0 ? INDEX_INIT_SIZE : ix->capacity*2;
+    void* m;
+    if(ix->capacity == 0)
+        m = mmap(NULL,capacity*2*sizeof(size_t),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    else
+        m = mremap(ix->sizes,ix->capacity*2*sizeof(size_t),capacity*2*sizeof(size_t),MREMAP_MAYMOVE);
+    if(m == MAP_FAILED)
+        return false;
+    ix->sizes = (size_t*)m;
+    memmove(ix->sizes+capacity,ix->sizes+ix->capacity,ix->count*sizeof(memory_block*));
+    ix->blocks = (memory_block**)(ix->sizes+capacity);
+    ix->capacity = capacity;
+    return true;
+}
+
+// append block to freelist index
+// block that doesn't fit is left out of it, it can't be found by search but is still merged
+static inline void index_add(block_index* ix, memory_block* b){
+    if(!index_reserve(ix)){
+        b->slot = INDEX_NONE;
+        return;
+    }
+    ix->sizes[ix->count] = block_size(b);
+    ix->blocks[ix->count] = b;
+    b->slot = ix->count++;
+}
+
+// remove block from freelist index
+static inline void index_remove(block_index* ix, memory_block* b){
+    if(b->slot == INDEX_NONE)
+        return;
+    if(b->slot + 1 == ix->count){
+        // trailing holes are dropped right away
+        --ix->count;
+        while(ix->count > 0 && ix->sizes[ix->count-1] == 0){
+            --ix->count;
+            --ix->holes;
         }
     }else{
-        // add first memory block
-        memory_block* b = freelist_begin;
-        block_link_right(b, block);
+        ix->sizes[b->slot] = 0;
+        ++ix->holes;
+    }
+}
+
+// put block nb in place of block b in freelist index
+static inline void index_replace(block_index* ix, memory_block* b, memory_block* nb){
+    nb->slot = b->slot;
+    if(nb->slot == INDEX_NONE)
+        return;
+    ix->sizes[nb->slot] = block_size(nb);
+    ix->blocks[nb->slot] = nb;
+}
+
+// find last slot of block of at least size ns in sizes of n blocks
+static size_t index_scan_scalar(const size_t* sizes, size_t n, size_t ns){
+    while(n > 0){
+        --n;
+        if(sizes[n] >= ns)
+            return n;
+    }
+    return INDEX_NONE;
+}
+
+#if defined(__x86_64__)
+// block sizes are below 2^63 so signed compare works for them
+__attribute__((target("sse4.2")))
+static size_t index_scan_sse42(const size_t* sizes, size_t n, size_t ns){
+    __m128i v = _mm_set1_epi64x(ns - 1);
+    while(n >= 8){
+        n -= 8;
+        int m = (_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm_loadu_si128((const __m128i*)(sizes+n+6)),v))) << 6) |
+                (_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm_loadu_si128((const __m128i*)(sizes+n+4)),v))) << 4) |
+                (_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm_loadu_si128((const __m128i*)(sizes+n+2)),v))) << 2) |
+                _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm_loadu_si128((const __m128i*)(sizes+n)),v)));
+        if(m != 0)
+            return n + 31 - __builtin_clz(m);
+    }
+    return index_scan_scalar(sizes,n,ns);
+}
+
+__attribute__((target("avx2")))
+static size_t index_scan_avx2(const size_t* sizes, size_t n, size_t ns){
+    __m256i v = _mm256_set1_epi64x(ns - 1);
+    while(n >= 16){
+        n -= 16;
+        int m = (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i*)(sizes+n+12)),v))) << 12) |
+                (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i*)(sizes+n+8)),v))) << 8) |
+                (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i*)(sizes+n+4)),v))) << 4) |
+                _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i*)(sizes+n)),v)));
+        if(m != 0)
+            return n + 31 - __builtin_clz(m);
+    }
+    return index_scan_sse42(sizes,n,ns);
+}
+#endif
+
+// search kernel is picked on first use from what cpu supports
+static size_t (*index_scan)(const size_t*, size_t, size_t) = null;
+
+// find slot of last added block of at least size ns in freelist index
+static inline size_t index_find(block_index* ix, size_t ns){
+    if(index_scan == null){
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+            index_scan = index_scan_avx2;
+        else if(__builtin_cpu_supports("sse4.2"))
+            index_scan = index_scan_sse42;
+        else
+#endif
+            index_scan = index_scan_scalar;
+    }
+    return index_scan(ix->sizes,ix->count,ns);
+}
+
+// mark block as free and let right adjacent block know about it
+static inline void mark_block_free(memory_block* b){
+    b->size |= BLOCK_FREE;
+    block_footer(b) = block_size(b);
+    block_end(b)->size |= BLOCK_PREV_FREE;
+}
+
+// mark block as used and let right adjacent block know about it
+static inline void mark_block_used(memory_block* b){
+    b->size &= ~BLOCK_FREE;
+    block_end(b)->size &= ~BLOCK_PREV_FREE;
+}
+
+// reserve address space for chunks aligned to CHUNK_SIZE
+// if that much address space isn't available half as much is tried
+static inline bool heap_reserve(){
+    if(heap_reserve_start != null)
+        return heap_reserve_start != MAP_FAILED;
+    for(size_t s = HEAP_RESERVE_SIZE; s >= CHUNK_SIZE; s /= 2){
+        // one chunk more is reserved so that reservation can be aligned
+        uint8_t* m = mmap(null,s + CHUNK_SIZE,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+        if(m == MAP_FAILED)
+            continue;
+        uint8_t* c = byte_ptr(chunk_start(m + CHUNK_SIZE - 1));
+        if(c > m)
+            munmap(m,c - m);
+        munmap(c + s,m + CHUNK_SIZE - c);
+        heap_reserve_top = c;
+        heap_reserve_end = c + s;
+        heap_reserve_start = c;
+        return true;
     }
+    heap_reserve_start = heap_reserve_end = MAP_FAILED;
+    return false;
+}
+
+#ifdef BACKGROUND_THREAD
+// background thread
+// chunks and mmap blocks to be unmapped are pushed to a lock free list that background
+// thread takes as a whole, once per decay step it also does purging and merging that
+// freeing threads would do otherwise so that they don't make those syscalls, least of
+// all while holding locks. thread is started on first free as creating it allocates memory.
+// freeing thread unmaps by itself if thread isn't running or BACKGROUND_PENDING bytes are queued
+#define BG_NONE 0
+#define BG_STARTING 1
+#define BG_RUNNING 2
+#define BG_FAILED 3
+static uint32_t bg_state = BG_NONE;
+static memory_block* bg_queue = null; // blocks to unmap linked through next
+static size_t bg_pending = 0; // bytes in queue
+static uint32_t bg_signal = 0; // set when queue becomes non empty, background thread sleeps on it
+static uint64_t bg_step = 0; // decay step background thread last did its work at
+#define bg_active() (__atomic_load_n(&bg_state,__ATOMIC_ACQUIRE) == BG_RUNNING)
+
+// queue chunk or mmap block b of s bytes to be unmapped by background thread
+// false is returned if caller has to unmap it
+static inline bool bg_push(memory_block* b, size_t s){
+    if(!bg_active())
+        return false;
+    if(__atomic_add_fetch(&bg_pending,s,__ATOMIC_RELAXED) > BACKGROUND_PENDING){
+        __atomic_sub_fetch(&bg_pending,s,__ATOMIC_RELAXED);
+        return false;
+    }
+    memory_block* h = __atomic_load_n(&bg_queue,__ATOMIC_RELAXED);
+    do{
+        b->next = h;
+    }while(!__atomic_compare_exchange_n(&bg_queue,&h,b,true,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+    if(h == null && __atomic_exchange_n(&bg_signal,1,__ATOMIC_RELEASE) == 0)
+        futex_wake(&bg_signal,1);
+    return true;
+}
+#else
+#define bg_active() false
+#define bg_push(b,s) false
+#endif
+
+// commit new chunk from reservation
+// slots are released by background thread without heap lock so bitmap is updated atomically
+static inline memory_block* chunk_map(){
+    if(!heap_reserve())
+        return null;
+    uint8_t* c = null;
+    // decommitted chunk slots are reused first, only words of slots committed before are looked at
+    size_t n = ((heap_reserve_top - heap_reserve_start)/CHUNK_SIZE + 63)/64;
+    for(size_t i = 0; c == null && i < n; ++i){
+        uint64_t w = __atomic_load_n(&(heap_reserve_free[i]),__ATOMIC_ACQUIRE);
+        if(w != 0){
+            __atomic_fetch_and(&(heap_reserve_free[i]),~(w & -w),__ATOMIC_ACQ_REL);
+            c = heap_reserve_start + (i*64 + __builtin_ctzl(w))*CHUNK_SIZE;
+        }
+    }
+    if(c == null){
+        if(heap_reserve_top == heap_reserve_end)
+            return null;
+        c = heap_reserve_top;
+        heap_reserve_top += CHUNK_SIZE;
+    }
+    if(mprotect(c,CHUNK_SIZE,PROT_READ|PROT_WRITE) != 0){
+        size_t i = (c - heap_reserve_start)/CHUNK_SIZE;
+        __atomic_fetch_or(&(heap_reserve_free[i/64]),1UL << (i%64),__ATOMIC_RELEASE);
+        return null;
+    }
+#ifdef HEAP_HUGEPAGE
+    // decommitted slot lost its advice so it's given on every commit
+    madvise(c,CHUNK_SIZE,MADV_HUGEPAGE);
+#endif
+    chunk_fence(c)->size = 0;
+    return (memory_block*)c;
+}
+
+// give chunk c back to the operating system keeping its slot reserved
+static inline void chunk_release(memory_block* c){
+    // mapping it again without access drops its pages and commit charge
+    mmap(c,CHUNK_SIZE,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED,-1,0);
+    size_t i = (byte_ptr(c) - heap_reserve_start)/CHUNK_SIZE;
+    __atomic_fetch_or(&(heap_reserve_free[i/64]),1UL << (i%64),__ATOMIC_RELEASE);
+}
+
+// give chunk c back to the operating system in background or right away
+static inline void chunk_unmap(memory_block* c){
+    if(!bg_push(c,CHUNK_SIZE))
+        chunk_release(c);
+}
+
+// purging
+// whole pages inside free blocks are given back to the operating system once they stayed
+// free long enough. pages freed k decay steps ago may stay resident as long as all resident
+// free bytes don't exceed bytes freed in last steps weighted by 1 - smoothstep(k/PURGE_STEPS)
+// so that memory freed in a burst is given back gradually, oldest first, and memory that is
+// reused soon isn't purged and faulted in again
+#define purge_step_of(t) ((t)/(purge_decay_time/PURGE_STEPS))
+#define PURGE_MIN_SIZE (2*PAGE_MAP_PAGE) // free blocks smaller than this might have no whole page
+#ifdef PURGE_LAZY
+#define PURGE_ADVICE MADV_FREE
+#else
+#define PURGE_ADVICE MADV_DONTNEED
+#endif
+static uint64_t purge_step = 0; // decay step free pages were last checked at
+static uint64_t freed_step = 0; // decay step of the newest purge_freed entry
+static size_t purge_freed[PURGE_STEPS]; // bytes freed in last decay steps
+
+// coarse monotonic time in ns
+static inline uint64_t heap_clock(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+    return (uint64_t)ts.tv_sec*1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+// count s bytes freed at time t
+static inline void purge_count(uint64_t t, size_t s){
+    uint64_t n = purge_step_of(t);
+    if(n != freed_step){
+        // entries of steps that passed since are reused
+        for(uint64_t m = n; m > freed_step && m + PURGE_STEPS > n; --m)
+            purge_freed[m % PURGE_STEPS] = 0;
+        freed_step = n;
+    }
+    if(s >= PURGE_MIN_SIZE)
+        purge_freed[n % PURGE_STEPS] += s;
+}
+
+// give whole pages between a and b back to the operating system
+static inline bool purge_range(uint8_t* a, uint8_t* b){
+    uintptr_t s = ((uintptr_t)a + PAGE_MAP_PAGE - 1) & ~(PAGE_MAP_PAGE - 1);
+    uintptr_t e = (uintptr_t)b & ~(PAGE_MAP_PAGE - 1);
+    if(e <= s)
+        return false;
+    madvise((void*)s,e - s,PURGE_ADVICE);
+    return true;
+}
+
+// give pages of free block b back to the operating system, its header and footer stay
+static inline bool purge_block(memory_block* b){
+    b->stamp = 0;
+    return purge_range(byte_ptr(b) + sizeof(memory_block),byte_ptr(block_end(b)) - sizeof(size_t));
+}
+
+// add block to free list
+// adjacent free blocks are found using boundary tags and merged with it
+// block adjacent to top block is merged into top block instead
+// null is returned if block's chunk was unmapped
+static inline memory_block* add_block(memory_block* block){
+    // merge left adjacent block
+    if(block->size & BLOCK_PREV_FREE){
+        memory_block* lb = block_left(block);
+        block_unlink(lb);
+        index_remove(&freelist_index,lb);
+        lb->size += block_size(block);
+        block = lb;
+    }
+    // merge right adjacent block
+    memory_block* rb = block_end(block);
+    if(rb == heap_top){
+        // block becomes start of top block
+        heap_top_move(block);
+        heap_top_stamp = heap_clock();
+        return block;
+    }
+    if(rb->size & BLOCK_FREE){
+        block_unlink(rb);
+        index_remove(&freelist_index,rb);
+        block->size += block_size(rb);
+    }
+    // chunk that became a single free block is given back to the operating system
+    if(chunk_free(block)){
+        heap_size -= CHUNK_SIZE;
+        chunk_unmap(block);
+        return null;
+    }
+    mark_block_free(block);
+    block->stamp = heap_clock();
+    purge_count(block->stamp,block_size(block));
+
+    // insert block at the start of free list
+    memory_block* b = freelist_begin;
+    block_link_right(b, block);
+    index_add(&freelist_index,block);
+    return block;
 }
 
 // split memory block into 2 pieces one of size s and the other is remainder e.g. memory_block_size-s
 // if remainder is less than MIN_BLOCK_SIZE we just take whole block
 static inline memory_block* split_memory_block(memory_block* b, size_t s){
-    size_t remainder = b->size - s;
-    if(remainder >= MIN_BLOCK_SIZE){
+    size_t remainder = block_size(b) - s;
+    if(remainder >= min_block_size){
         memory_block* nb = shift_block_ptr(b,+s);
-        nb->size = remainder;
-        block_replace(b,nb);
-        b->size = s;
+        memory_block* temp_prev = b->prev;
+        memory_block* temp_next = b->next;
+        nb->size = remainder | BLOCK_FREE;
+        nb->stamp = b->stamp;
+        block_footer(nb) = remainder;
+        block_link(temp_prev,nb);
+        block_link(nb,temp_next);
+        index_replace(&freelist_index,b,nb);
+        b->size = s | (b->size & BLOCK_PREV_FREE);
     }else{
         block_unlink(b);
+        index_remove(&freelist_index,b);
+        mark_block_used(b);
     }
     return b;
 }
 
-// find optimal memory block size for size s
-static inline size_t find_optimal_memory_size(size_t s){
-    size_t suitable_size = MIN_BLOCK_SIZE;
+// split used memory block so that its size is s and add remainder to free list
+static inline void split_used_block(memory_block* b, size_t s){
+    size_t remainder = block_size(b) - s;
+    if(remainder >= min_block_size){
+        memory_block* nb = shift_block_ptr(b,+s);
+        b->size = s | (b->size & BLOCK_PREV_FREE);
+        nb->size = remainder;
+        add_block(nb);
+    }
+}
 
-    while(suitable_size < s)
-        suitable_size = suitable_size << 1;
+// size classes
+// 8 classes of 16 bytes up to 128 bytes and 4 classes for every power of 2 after that
+#define SIZE_CLASS_COUNT 80
+static const size_t size_classes[SIZE_CLASS_COUNT] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+    5120, 6144, 7168, 8192,
+    10240, 12288, 14336, 16384,
+    20480, 24576, 28672, 32768,
+    40960, 49152, 57344, 65536,
+    81920, 98304, 114688, 131072,
+    163840, 196608, 229376, 262144,
+    327680, 393216, 458752, 524288,
+    655360, 786432, 917504, 1048576,
+    1310720, 1572864, 1835008, 2097152,
+    2621440, 3145728, 3670016, 4194304,
+    5242880, 6291456, 7340032, 8388608,
+    10485760, 12582912, 14680064, 16777216,
+    20971520, 25165824, 29360128, 33554432,
+};
 
-    return suitable_size;
+// find size class for size s
+// sizes up to 128 are treated as if they were in 64..128 power of 2 range
+// so both ranges are computed with the same shift
+static inline unsigned int size_class(size_t s){
+    size_t m = (s - 1) | 64;
+    unsigned int k = 63 - __builtin_clzl(m);
+    return ((k - 6) << 2) + ((s - 1) >> (k - 2));
+}
+
+// find optimal memory block size for size s
+static inline size_t find_optimal_memory_size(size_t s){
+    if(s < min_block_size)
+        s = min_block_size;
+    unsigned int c = size_class(s);
+    // sizes beyond last size class are only allocated with mmap
+    if(c >= SIZE_CLASS_COUNT)
+        return s;
+    return size_classes[c];
 }
 
 // find suitable memory block for size s
+// first fit is searched in freelist index instead of walking freelist
 static inline memory_block* find_suitable_block(size_t ns){
+    size_t i = index_find(&freelist_index,ns);
+    if(i == INDEX_NONE)
+        return null;
+    return split_memory_block(freelist_index.blocks[i],ns);
+}
 
-    memory_block* b = freelist_start;
-    while(b != freelist_end){
-        if(b->size >= ns){
-            return split_memory_block(b,ns);                    
+// find quick list for block of size s
+// block must be at least as big as its size class
+static inline unsigned int quick_class(size_t s){
+    unsigned int c = size_class(s);
+    if(size_classes[c] > s)
+        --c;
+    return c;
+}
+
+// push freed block to its quick list
+static inline void quick_push(memory_block* b){
+    unsigned int c = quick_class(block_size(b));
+    b->next = quick_lists[c];
+    quick_lists[c] = b;
+    quick_size += block_size(b);
+}
+
+// pop block of size class of ns from its quick list
+static inline memory_block* quick_pop(size_t ns){
+    unsigned int c = size_class(ns);
+    memory_block* b = quick_lists[c];
+    if(b != null){
+        quick_lists[c] = b->next;
+        quick_size -= block_size(b);
+    }
+    return b;
+}
+
+// merge all blocks from quick lists into freelist
+static inline void quick_consolidate(){
+    for(unsigned int c = 0; c < QUICK_CLASS_COUNT; ++c){
+        memory_block* b = quick_lists[c];
+        quick_lists[c] = null;
+        while(b != null){
+            memory_block* nb = b->next;
+            add_block(b);
+            b = nb;
         }
-        b = b->next;
     }
+    quick_size = 0;
+}
+
+#ifdef HEAP_HUGEPAGE
+// map s bytes aligned to HUGE_PAGE_SIZE and ask for them to be backed by huge pages
+static void* huge_map(size_t s){
+    uint8_t* m = mmap(null,s + HUGE_PAGE_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if(m == MAP_FAILED)
+        return MAP_FAILED;
+    uint8_t* a = (uint8_t*)(((uintptr_t)m + HUGE_PAGE_SIZE - 1) & ~((uintptr_t)HUGE_PAGE_SIZE - 1));
+    if(a > m)
+        munmap(m,a - m);
+    munmap(a + s,m + HUGE_PAGE_SIZE - a);
+    madvise(a,s,MADV_HUGEPAGE);
+    return a;
+}
+#endif
+
+// reserve address space for slabs
+static inline bool slab_init(){
+    if(slab_region_start != null)
+        return slab_region_start != MAP_FAILED;
+#ifdef HEAP_HUGEPAGE
+    // slabs of all size classes are packed together in huge pages
+    void* m = huge_map(SLAB_REGION_SIZE);
+    void* d = huge_map((SLAB_REGION_SIZE/SLAB_SIZE)*sizeof(slab));
+#else
+    void* m = mmap(NULL,SLAB_REGION_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    void* d = mmap(NULL,(SLAB_REGION_SIZE/SLAB_SIZE)*sizeof(slab),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+#endif
+    if(m == MAP_FAILED || d == MAP_FAILED){
+        if(m != MAP_FAILED)
+            munmap(m,SLAB_REGION_SIZE);
+        if(d != MAP_FAILED)
+            munmap(d,(SLAB_REGION_SIZE/SLAB_SIZE)*sizeof(slab));
+        // slabs are disabled and small objects are allocated from heap
+        slab_region_start = slab_region_end = MAP_FAILED;
+        return false;
+    }
+    slabs = (slab*)d;
+    slab_region_start = slab_region_top = (uint8_t*)m;
+    slab_region_end = slab_region_start + SLAB_REGION_SIZE;
+    return true;
+}
 
+// link slab at the start of slab list l
+#define slab_link(l,sl) \
+    sl->prev = null; \
+    sl->next = l; \
+    if(l != null) \
+        l->prev = sl; \
+    l = sl;
+
+// unlink slab from slab list l
+#define slab_unlink(l,sl) \
+    if(sl->prev != null) \
+        sl->prev->next = sl->next; \
+    else \
+        l = sl->next; \
+    if(sl->next != null) \
+        sl->next->prev = sl->prev;
+
+// push object to free stack of size class c unless it's full
+FREE_STACK_CAS static bool free_stack_push(uint8_t c, void* p){
+    free_stack* st = &(free_stacks[c]);
+    free_stack_head o, n;
+    o.word = st->head.word;
+    while(1){
+        if(o.count >= FREE_STACK_DEPTH)
+            return false;
+        *((void**)p) = o.top;
+        n.top = p;
+        n.tag = o.tag + 1;
+        n.count = o.count + 1;
+        unsigned __int128 r = __sync_val_compare_and_swap(&(st->head.word), o.word, n.word);
+        if(r == o.word)
+            return true;
+        o.word = r;
+    }
+}
+
+// pop object from free stack of size class c
+FREE_STACK_CAS static void* free_stack_pop(uint8_t c){
+    free_stack* st = &(free_stacks[c]);
+    free_stack_head o, n;
+    o.word = st->head.word;
+    while(1){
+        if(o.top == null)
+            return null;
+        n.top = *((void**)o.top);
+        n.tag = o.tag + 1;
+        n.count = o.count - 1;
+        unsigned __int128 r = __sync_val_compare_and_swap(&(st->head.word), o.word, n.word);
+        if(r == o.word)
+            return o.top;
+        o.word = r;
+    }
+}
+
+// get empty slab for size class c
+static inline slab* slab_new(uint8_t c){
+    slab* sl = slab_empty;
+    if(sl != null){
+        slab_empty = sl->next;
+    }else{
+        if(!slab_init() || slab_region_top == slab_region_end)
+            return null;
+        sl = ptr_slab(slab_region_top);
+        slab_region_top += SLAB_SIZE;
+    }
+    // free finds out size class of the object from page map
+    if(!page_map_set(slab_start(sl),SLAB_SIZE,PAGE_SLAB+c)){
+        sl->next = slab_empty;
+        slab_empty = sl;
+        return null;
+    }
+    sl->free = null;
+    sl->top = 0;
+    sl->used = 0;
+    sl->size = size_classes[c];
+    slab_link(slab_partial[c],sl);
+    ++slab_count[c];
+    return sl;
+}
+
+// allocate object of size s from slab
+static inline void* slab_alloc(size_t s){
+    uint8_t c = size_class(s);
+    slab* sl = slab_partial[c];
+    if(sl == null){
+        sl = slab_new(c);
+        if(sl == null)
+            return null;
+    }
+
+    void* o = sl->free;
+    if(o != null){
+        sl->free = *((void**)o);
+    }else{
+        o = slab_start(sl) + sl->top;
+        sl->top += sl->size;
+    }
+    ++sl->used;
+    ++slab_used[c];
+    if(slab_full(sl)){
+        slab_unlink(slab_partial[c],sl);
+    }
+    return o;
+}
+
+// return object of size class c back to its slab
+static inline void slab_free(uint8_t c, void* p){
+    slab* sl = ptr_slab(p);
+    bool full = slab_full(sl);
+    *((void**)p) = sl->free;
+    sl->free = p;
+    --sl->used;
+    --slab_used[c];
+    if(sl->used == 0){
+        // give slab to any size class that needs it
+        if(!full){
+            slab_unlink(slab_partial[c],sl);
+        }
+        sl->next = slab_empty;
+        slab_empty = sl;
+        --slab_count[c];
+    }else if(full){
+        slab_link(slab_partial[c],sl);
+    }
+}
+
+// cut block of size s from the start of top block
+// remainder that is less than MIN_BLOCK_SIZE is cut with it leaving top block empty
+static inline memory_block* top_alloc(size_t s){
+    if(heap_top == null || heap_top_size < s)
+        return null;
+    if(heap_top_size - s < min_block_size)
+        s = heap_top_size;
+    memory_block* b = heap_top;
+    b->size = s;
+    heap_top_move(shift_block_ptr(b,+s));
+    return b;
+}
+
+// map new chunk and make it current one, what's left of top block of the previous one is freed
+static inline bool grow_heap(){
+    memory_block* c = chunk_map();
+    if(c == null)
+        return false;
+    heap_size += CHUNK_SIZE;
+    memory_block* t = heap_top;
+    heap_end = chunk_fence(c);
+    heap_top_move(c);
+    heap_top_stamp = 0;
+    if(t != null && t == chunk_start(t)){
+        // whole previous chunk was free
+        heap_size -= CHUNK_SIZE;
+        chunk_unmap(t);
+    }else if(t != null && block_size(t) > 0){
+        // empty top block was fence of previous chunk and stays so
+        add_block(t);
+    }
+    return true;
+}
+
+// give current chunk back to the operating system if it's empty and isn't the only one
+static inline void shrink_heap(){
+    if(heap_top == null || heap_top != chunk_start(heap_top) || heap_size <= CHUNK_SIZE)
+        return;
+    heap_size -= CHUNK_SIZE;
+    chunk_unmap(heap_top);
+    heap_top = null;
+    heap_end = null;
+    heap_top_stamp = 0;
+}
+
+// purge pages of top block if nothing was merged into it for PURGE_DECAY_TIME or if force is set
+// first pad bytes of top block stay
+static inline bool heap_purge(uint64_t now, bool force, size_t pad){
+    if(heap_top == null || heap_top_stamp == 0 || (!force && now - heap_top_stamp < purge_decay_time))
+        return false;
+    heap_top_stamp = 0;
+    if(pad > heap_top_size)
+        return false;
+    return purge_range(byte_ptr(heap_top) + sizeof(size_t) + pad,byte_ptr(heap_end));
+}
+
+// purge pages of freelist that outlived their share of decay curve, oldest first.
+// blocks freed before last PURGE_STEPS steps are always purged and blocks freed
+// in the current step never are unless force is set in which case all are purged
+static bool freelist_purge(uint64_t now, bool force){
+    block_index* ix = &freelist_index;
+    uint64_t n = purge_step_of(now);
+    purge_count(now,0);
+    purge_step = n;
+    double limit = 0;
+    for(uint64_t k = 0; k < PURGE_STEPS && !force; ++k){
+        double x = (double)k/PURGE_STEPS;
+        limit += purge_freed[(n - k) % PURGE_STEPS] * (1 - x*x*(3 - 2*x));
+    }
+    size_t dirty = 0;
+    for(size_t i = 0; i < ix->count; ++i){
+        if(ix->sizes[i] >= PURGE_MIN_SIZE && ix->blocks[i]->stamp != 0)
+            dirty += ix->sizes[i];
+    }
+    bool purged = false;
+    for(uint64_t k = PURGE_STEPS; k > 0 && dirty > 0 && (k == PURGE_STEPS || dirty > limit); --k){
+        for(size_t i = 0; i < ix->count && (k == PURGE_STEPS || dirty > limit); ++i){
+            memory_block* b = ix->blocks[i];
+            if(ix->sizes[i] < PURGE_MIN_SIZE || b->stamp == 0)
+                continue;
+            if(!force && n - purge_step_of(b->stamp) < k)
+                continue;
+            purged |= purge_block(b);
+            dirty -= ix->sizes[i];
+        }
+    }
+    return purged;
+}
+
+// mmap cache
+// released mmap blocks are kept mapped in buckets by size class of their page count so
+// that later large requests reuse them instead of mapping and faulting in fresh pages.
+// blocks of a bucket are kept oldest first, full bucket gives up its oldest block and
+// blocks that stay in cache for PURGE_DECAY_TIME are unmapped.
+// mmap blocks keep their page rounded length in size and stay in page map while cached
+typedef struct {
+    memory_block* blocks[MMAP_CACHE_DEPTH];
+    uint64_t stamps[MMAP_CACHE_DEPTH]; // time block was cached
+    uint32_t count;
+} mmap_bucket;
+static mmap_bucket mmap_cache[SIZE_CLASS_COUNT];
+static size_t mmap_cache_size = 0; // bytes in cache
+static uint64_t mmap_cache_step = 0; // decay step cache was last checked at
+static uint64_t mmap_cache_hits = 0;
+static uint64_t mmap_cache_misses = 0;
+static size_t mmap_released_size = 0; // length of block unmapped last, 0 once it raised threshold
+static uint64_t mmap_released_time = 0; // time it was taken out of cache
+#define mmap_length(s) (((s) + PAGE_MAP_PAGE - 1) & ~(PAGE_MAP_PAGE - 1))
+
+// take i-th block out of bucket bk
+static inline memory_block* mmap_bucket_take(mmap_bucket* bk, uint32_t i){
+    memory_block* b = bk->blocks[i];
+    for(--bk->count; i < bk->count; ++i){
+        bk->blocks[i] = bk->blocks[i+1];
+        bk->stamps[i] = bk->stamps[i+1];
+    }
+    mmap_cache_size -= b->size;
+    return b;
+}
+
+// take cached block of at least s bytes, most recently cached first
+// blocks of the same size are pushed into bucket found rounding down so it's checked
+// first and then the one found rounding up where any block fits
+static inline memory_block* mmap_cache_pop(size_t s){
+    unsigned int c = size_class(s);
+    unsigned int lc = c < SIZE_CLASS_COUNT && size_classes[c] > s && c > 0 ? c - 1 : c;
+    for(; lc <= c && lc < SIZE_CLASS_COUNT; ++lc){
+        mmap_bucket* bk = &(mmap_cache[lc]);
+        for(uint32_t i = bk->count; i > 0; --i){
+            if(bk->blocks[i-1]->size >= s){
+                ++mmap_cache_hits;
+                return mmap_bucket_take(bk,i-1);
+            }
+        }
+    }
+    ++mmap_cache_misses;
     return null;
 }
 
+// cache released block b, block that has to be unmapped instead is returned
+// and its page map entry is cleared
+static inline memory_block* mmap_cache_push(memory_block* b, uint64_t t){
+    // bucket is found rounding down so that any block of it fits requests of its size class
+    unsigned int c = size_class(b->size);
+    if(c < SIZE_CLASS_COUNT && size_classes[c] > b->size)
+        --c;
+    memory_block* ob = b;
+    if(c < SIZE_CLASS_COUNT){
+        mmap_bucket* bk = &(mmap_cache[c]);
+        size_t out = bk->count == MMAP_CACHE_DEPTH ? bk->blocks[0]->size : 0;
+        if(mmap_cache_size - out + b->size <= mmap_cache_max){
+            ob = out > 0 ? mmap_bucket_take(bk,0) : null;
+            bk->blocks[bk->count] = b;
+            bk->stamps[bk->count] = t;
+            ++bk->count;
+            mmap_cache_size += b->size;
+        }
+    }
+    if(ob != null){
+        page_map_set(ob,1,PAGE_NONE);
+        mmap_released_size = ob->size;
+        mmap_released_time = t;
+    }
+    return ob;
+}
+
+// take blocks that stayed in cache for PURGE_DECAY_TIME out of it, all of them if force is set
+// they are returned as a list linked through next so that they're unmapped without the lock
+static inline memory_block* mmap_cache_decay(uint64_t now, bool force){
+    memory_block* l = null;
+    mmap_cache_step = purge_step_of(now);
+    for(unsigned int c = 0; c < SIZE_CLASS_COUNT; ++c){
+        mmap_bucket* bk = &(mmap_cache[c]);
+        while(bk->count > 0 && (force || now - bk->stamps[0] >= purge_decay_time)){
+            memory_block* b = mmap_bucket_take(bk,0);
+            page_map_set(b,1,PAGE_NONE);
+            mmap_released_size = b->size;
+            mmap_released_time = now;
+            b->next = l;
+            l = b;
+        }
+    }
+    return l;
+}
+
+// unmap mmap blocks of list l
+static inline void mmap_unmap(memory_block* l){
+    while(l != null){
+        memory_block* nb = l->next;
+        if(!bg_push(l,l->size))
+            munmap(l,l->size);
+        l = nb;
+    }
+}
+
+// key k of length n is name
+#define conf_key(k,n,name) ((n) == sizeof(name) - 1 && strncmp(k,name,n) == 0)
+
+// read tunables from MYMALLOC_CONF and bring them into range
+// nothing is allocated meanwhile as it's done on first malloc
+static void conf_init(){
+    lock
+    if(!conf_ready){
+        const char* c = getenv("MYMALLOC_CONF");
+        while(c != null && *c != 0){
+            const char* e = strchr(c,',');
+            if(e == null)
+                e = c + strlen(c);
+            const char* v = memchr(c,':',e - c);
+            char* ve = null;
+            size_t x = v != null ? strtoul(v + 1,&ve,0) : 0;
+            // pairs without a number are ignored
+            if(v != null && ve != v + 1){
+                size_t n = v - c;
+                if(conf_key(c,n,"min_block_size"))
+                    min_block_size = x;
+                else if(conf_key(c,n,"mmap_threshold")){
+                    mmap_threshold = x;
+                    mmap_threshold_fixed = true;
+                }else if(conf_key(c,n,"mmap_threshold_max"))
+                    mmap_threshold_max = x;
+                else if(conf_key(c,n,"mmap_cache_size"))
+                    mmap_cache_max = x;
+                else if(conf_key(c,n,"decay_ms"))
+                    purge_decay_time = x*1000000;
+                else if(conf_key(c,n,"merge_adj_on_realloc"))
+                    merge_adj_on_realloc = x != 0;
+            }
+            c = *e == ',' ? e + 1 : e;
+        }
+        // blocks must hold free block header and footer
+        if(min_block_size < MIN_BLOCK_SIZE)
+            min_block_size = MIN_BLOCK_SIZE;
+        if(min_block_size > QUICK_MAX_SIZE)
+            min_block_size = QUICK_MAX_SIZE;
+        min_block_size = (min_block_size + 15) & ~15UL;
+        // heap blocks must fit into a chunk
+        if(mmap_threshold_max > CHUNK_SIZE/2)
+            mmap_threshold_max = CHUNK_SIZE/2;
+        if(mmap_threshold > mmap_threshold_max)
+            mmap_threshold = mmap_threshold_max;
+        if(purge_decay_time < 1000000)
+            purge_decay_time = 1000000;
+        __atomic_store_n(&conf_ready,true,__ATOMIC_RELEASE);
+    }
+    unlock
+}
+
+static inline void conf_load(){
+    if(!__atomic_load_n(&conf_ready,__ATOMIC_ACQUIRE))
+        conf_init();
+}
+
+// raise mmap threshold past length s of mmap request that missed the cache at time now
+// if block of its size class was unmapped within decay time, unless threshold was set
+// explicitly. requests of that size class are cut from heap from then on, lock must be held
+static inline void mmap_threshold_adjust(size_t s, uint64_t now){
+    if(mmap_released_size == 0 || now - mmap_released_time > purge_decay_time ||
+        size_class(s) != size_class(mmap_released_size))
+        return;
+    mmap_released_size = 0;
+    if(__atomic_load_n(&mmap_threshold_fixed,__ATOMIC_RELAXED) ||
+        s <= __atomic_load_n(&mmap_threshold,__ATOMIC_RELAXED) || s > mmap_threshold_max)
+        return;
+    __atomic_store_n(&mmap_threshold,find_optimal_memory_size(s) + 1,__ATOMIC_RELAXED);
+}
+
+// allocate block of s bytes with mmap, released block of the same size is reused if cached
+static inline void* mmap_alloc(size_t s){
+    size_t ms = mmap_length(s);
+    uint64_t now = heap_clock();
+    lock
+    memory_block* b = mmap_cache_pop(ms);
+    if(b != null)
+        mmap_size += b->size;
+    else
+        mmap_threshold_adjust(ms,now);
+    unlock
+    if(b != null)
+        return block_data(b);
+    void* m = mmap(NULL,ms,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if(m == MAP_FAILED)
+        return null;
+    b = (memory_block*)m;
+    b->size = ms;
+    lock
+    if(!page_map_set(b,1,PAGE_MMAP)){
+        unlock
+        munmap(b,ms);
+        return null;
+    }
+    mmap_size += ms;
+    unlock
+    return block_data(b);
+}
+
 void* malloc(size_t s){
     // check for 0 size
     if(s == 0)
         return null;
+
+    // small sizes are allocated from free stacks or slabs
+    if(s <= SLAB_MAX_SIZE){
+        void* o = free_stack_pop(size_class(s));
+        if(o == null){
+            lock
+            o = slab_alloc(s);
+            unlock
+        }
+        if(o != null)
+            return o;
+    }
+
+    // tunables are read before anything is cut from heap or mapped
+    conf_load();
+
     // add size of size_t as we need to save size of memory block
     s += sizeof(size_t);
     // find suitable memory size
     size_t ns = find_optimal_memory_size(s);
 
-    // if size is greater than or equals MMAP_SIZE we are going to use mmap
-    if(ns >= MMAP_SIZE){
-        void* m = mmap(NULL,s,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
-        if(m == MAP_FAILED)
-            return null;
-        memory_block* b = (memory_block*)m;
-        b->size = s;
-        lock
-        mmap_size += s;
-        unlock
-        return block_data(b);
-    }
+    // if size is greater than or equals mmap threshold we are going to use mmap
+    if(ns >= __atomic_load_n(&mmap_threshold,__ATOMIC_RELAXED))
+        return mmap_alloc(s);
 
     lock
+    // recently freed block of the same size class
+    memory_block* block = null;
+    if(ns <= QUICK_MAX_SIZE)
+        block = quick_pop(ns);
     // find free memory block
-    memory_block* block = find_suitable_block(ns);
+    if(block == null)
+        block = find_suitable_block(ns);
+    // merge quick lists and try again
+    if(block == null && quick_size > 0){
+        quick_consolidate();
+        block = find_suitable_block(ns);
+    }
     if(block != null){
         unlock
         // shift pointer into data block pointer
@@ -252,91 +1412,58 @@ void* malloc(size_t s){
     }
 
     // no free memory blocks found
-    // we need to allocate new one that would be suitable for our needs using sbrk
-    size_t pages_size = ((ns/PAGE_SIZE)+1)*PAGE_SIZE;
-    if(pages_size < ALLOC_SIZE)
-        pages_size = ALLOC_SIZE;
-    // allocate memory with sbrk
-    void* p = sbrk(pages_size);
-    if(p == (void*)-1){
-        unlock
-        return null;
-    }
-
-    block = (memory_block*)p;
-    heap_size += pages_size;
-    block->size = ns;
-    heap_end = shift_block_ptr(block,+pages_size);
-    heap_start = shift_block_ptr(heap_end,-heap_size);
-    ns = pages_size - ns;
-    if(ns >= MIN_BLOCK_SIZE){
-        memory_block* b = shift_block_ptr(block,+block->size);
-        b->size = ns;
-        add_block(b);
-    }else
-        block->size = pages_size;
+    // cut new block from top block growing heap if needed
+    block = top_alloc(ns);
+    if(block == null && grow_heap())
+        block = top_alloc(ns);
     unlock
 
+    if(block == null)
+        return null;
+    // shift pointer into data block pointer
     return block_data(block);
 }
 
 // merge with adjacent block so that overall new size would be s
 static inline memory_block* merge_with_adjacent_block(memory_block* block, size_t s){
 
-    if(freelist_start == freelist_end)
-        return null;
+    // right adjacent top block, cut the rest from it
+    memory_block* b = block_end(block);
+    if(b == heap_top && block_size(block) + heap_top_size >= s){
+        // remainder that is less than MIN_BLOCK_SIZE is taken too leaving top block empty
+        if(block_size(block) + heap_top_size - s < min_block_size)
+            s = block_size(block) + heap_top_size;
+        heap_top_move(shift_block_ptr(block,+s));
+        block->size = s | (block->size & BLOCK_PREV_FREE);
+        return block;
+    }
 
-    memory_block* b = freelist_start;
-    memory_block* be = block_end(block);
-    do {
-        // left adjacent
-        // code is slightly more complex as we need to copy data over
-        if(block_end(b) == block){
-            size_t bs = b->size + block->size;
-            if(bs >= s){
-                size_t remainder = bs - s;
-                // we need to backup block pointers as they might be overwritten by memcpy
-                memory_block* temp_prev = b->prev;
-                memory_block* temp_next = b->next;
-                memcpy(block_data(b),block_data(block), block->size - sizeof(size_t));
-                if(remainder >= MIN_BLOCK_SIZE){
-                    b->size = s;
-                    memory_block* nb = shift_block_ptr(b,+s);
-                    nb->size = remainder;
-                    block_link(temp_prev,nb);
-                    block_link(nb,temp_next);
-                }else{
-                    b->size = bs;
-                    // unfortunetly here we can't use b->prev as
-                    // it might have been overwritten by memcpy
-                    // so we need to remove remaining block entirely using temporary pointers
-                    block_link(temp_prev,temp_next);
-                }
-                return b;
-            }
-        }
+    // right adjacent
+    if((b->size & BLOCK_FREE) && block_size(block) + block_size(b) >= s){
+        block_unlink(b);
+        index_remove(&freelist_index,b);
+        block->size += block_size(b);
+        mark_block_used(block);
+        split_used_block(block,s);
+        return block;
+    }
 
-        // right adjacent
-        if(be == b){
-            size_t bs = block->size + b->size;
-            if(bs >= s){
-                size_t remainder = bs - s;
-                if(remainder >= MIN_BLOCK_SIZE){
-                    memory_block* nb = shift_block_ptr(block,+s);
-                    nb->size = remainder;
-                    block_replace(b,nb);
-                    block->size = s;
-                }else{
-                    block_unlink(b);
-                    block->size = bs;
-                }
-                return block;
-            }
-            break;
+    // left adjacent
+    // code is slightly more complex as we need to copy data over
+    if(block->size & BLOCK_PREV_FREE){
+        b = block_left(block);
+        size_t bs = block_size(b) + block_size(block);
+        if(bs >= s){
+            block_unlink(b);
+            index_remove(&freelist_index,b);
+            // blocks might overlap so we need to use memmove
+            // after that block header might be overwritten
+            memmove(block_data(b),block_data(block), block_size(block) - sizeof(size_t));
+            b->size = bs | (b->size & BLOCK_PREV_FREE);
+            split_used_block(b,s);
+            return b;
         }
-
-        b = b->next;
-    } while(b != freelist_end && b >= be);
+    }
 
     return null;
 }
@@ -349,6 +1476,24 @@ void* realloc(void* p, size_t s){
         return null;
     }
 
+    // heap pointers are classified with range check and others using page map
+    uint8_t k = heap_contains(p) ? PAGE_HEAP : page_map_get(p);
+    if(k == PAGE_NONE)
+        return null;
+
+    // objects from slabs are moved if they don't fit anymore
+    if(k >= PAGE_SLAB){
+        size_t os = size_classes[k-PAGE_SLAB];
+        if(s <= os)
+            return p;
+        void* np = malloc(s);
+        if(np != null){
+            memcpy(np,p,os);
+            free(p);
+        }
+        return np;
+    }
+
     // shift pointer back into memory block pointer
     memory_block* b = data_block(p);
 
@@ -357,42 +1502,75 @@ void* realloc(void* p, size_t s){
     size_t ns = find_optimal_memory_size(ss);
 
     // if memory is mmap we need to use mremap
-    lock
-    if(is_mmap_block(b)){
-        mmap_size -= b->size;
+    // shrunk tail is unmapped in place and block is only moved if it can't be extended
+    if(k == PAGE_MMAP){
+        size_t os = b->size;
+        ss = mmap_length(ss);
+        if(ss == os)
+            return p;
+        // old range of moved block might be mapped by another thread as soon as mremap
+        // returns so page map entry of growing block is cleared before and set after it
+        bool grow = ss > os;
+        if(grow){
+            lock
+            page_map_set(b,1,PAGE_NONE);
+            unlock
+        }
+        void* m = mremap(b,os,ss,grow ? MREMAP_MAYMOVE : 0);
+        lock
+        if(m == MAP_FAILED){
+            if(grow)
+                page_map_set(b,1,PAGE_MMAP);
+            unlock
+            return null;
+        }
+        mmap_size -= os;
         mmap_size += ss;
+        // if moved block can't be registered it's leaked on free
+        if(grow)
+            page_map_set(m,1,PAGE_MMAP);
         unlock
-        void* p = mremap(b,b->size,ss,MREMAP_MAYMOVE);
-        if(p == MAP_FAILED)
-            return null;
-        b = (memory_block*)p;
+        b = (memory_block*)m;
         b->size = ss;
         return block_data(b);
     }
 
-    if(ns < MMAP_SIZE){
-        // check if size is already sufficient
-        if(b->size >= ns){
+    // check if size is already sufficient
+    // tail of shrunk block goes back to freelist merged with free blocks next to it so that
+    // it can be reused, its pages decay like those of any other free block
+    if(block_size(b) >= ns){
+        if(block_size(b) - ns >= min_block_size){
+            lock
+            split_used_block(b,ns);
             unlock
-            return p;
         }
+        return p;
+    }
 
-#ifdef MERGE_ADJ_ON_REALLOC
-        // try merging with adjacent blocks
+    lock
+
+    // try merging with adjacent blocks before moving
+    // block may grow past mmap threshold this way as long as it still fits a chunk
+    if(merge_adj_on_realloc && ns <= mmap_threshold_max){
         memory_block* nb = merge_with_adjacent_block(b,ns);
         if(nb != null){
             unlock
             // shift pointer into data block pointer
             return block_data(nb);
         }
-#endif
     }
     unlock
 
-    void* np = malloc(s);
+    // block that has to move goes to mmap if it's at least MMAP_SIZE even if mmap threshold
+    // rose since, mapped block then grows with mremap without being copied again. threshold
+    // that was set explicitly is used as is
+    size_t mt = __atomic_load_n(&mmap_threshold_fixed,__ATOMIC_RELAXED) ?
+        __atomic_load_n(&mmap_threshold,__ATOMIC_RELAXED) : MMAP_SIZE;
+    void* np = ns >= mt ? mmap_alloc(ss) : malloc(s);
     if(np != null){
         // copy old data block into new one
-        memcpy(np,p,s > b->size ? b->size : s);
+        size_t bs = block_size(b) - sizeof(size_t);
+        memcpy(np,p,s > bs ? bs : s);
 
         // free old data block
         free(p);
@@ -404,44 +1582,158 @@ void* realloc(void* p, size_t s){
     return null;
 }
 
+#ifdef BACKGROUND_THREAD
+// unmap blocks queued for background thread
+static void bg_drain(){
+    memory_block* l = __atomic_exchange_n(&bg_queue,null,__ATOMIC_ACQUIRE);
+    while(l != null){
+        memory_block* nb = l->next;
+        size_t s = CHUNK_SIZE;
+        if(heap_contains(l))
+            chunk_release(l);
+        else{
+            s = l->size;
+            munmap(l,s);
+        }
+        __atomic_sub_fetch(&bg_pending,s,__ATOMIC_RELAXED);
+        l = nb;
+    }
+}
+
+// purge free pages and decay mmap cache
+static void bg_maintain(uint64_t now){
+    lock
+    freelist_purge(now,false);
+    heap_purge(now,false,0);
+    memory_block* l = mmap_cache_decay(now,false);
+    unlock
+    mmap_unmap(l);
+}
+
+static void* bg_main(void* arg){
+    struct timespec ts = { (purge_decay_time/PURGE_STEPS)/1000000000, (purge_decay_time/PURGE_STEPS)%1000000000 };
+    while(1){
+        // woken up when blocks are queued and once per decay step
+        syscall(SYS_futex,&bg_signal,FUTEX_WAIT_PRIVATE,0,&ts,null,0);
+        __atomic_store_n(&bg_signal,0,__ATOMIC_RELAXED);
+        uint64_t now = heap_clock();
+        if(purge_step_of(now) != bg_step){
+            bg_step = purge_step_of(now);
+            bg_maintain(now);
+        }
+        bg_drain();
+    }
+    return null;
+}
+
+// background thread doesn't survive fork so child starts its own
+static void bg_child(){
+    bg_state = BG_NONE;
+}
+
+// start background thread, it's created with all signals blocked
+static void bg_create(){
+    uint32_t st = BG_NONE;
+    if(!__atomic_compare_exchange_n(&bg_state,&st,BG_STARTING,false,__ATOMIC_ACQ_REL,__ATOMIC_RELAXED))
+        return;
+    static bool bg_atfork = false;
+    if(!bg_atfork)
+        bg_atfork = pthread_atfork(null,null,bg_child) == 0;
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK,&all,&old);
+    pthread_attr_t at;
+    pthread_attr_init(&at);
+    pthread_attr_setdetachstate(&at,PTHREAD_CREATE_DETACHED);
+    pthread_t t;
+    int r = pthread_create(&t,&at,bg_main,null);
+    pthread_attr_destroy(&at);
+    pthread_sigmask(SIG_SETMASK,&old,null);
+    __atomic_store_n(&bg_state,r == 0 ? BG_RUNNING : BG_FAILED,__ATOMIC_RELEASE);
+}
+
+static inline void bg_start(){
+    if(__atomic_load_n(&bg_state,__ATOMIC_RELAXED) == BG_NONE)
+        bg_create();
+}
+#else
+#define bg_drain()
+#define bg_start()
+#endif
+
 void free(void* p){
     // check for null pointer
     if(p == null)
         return;
 
+    // heap pointers are classified with range check and others using page map
+    uint8_t k = heap_contains(p) ? PAGE_HEAP : page_map_get(p);
+
+    // return small object to free stack or its slab
+    if(k >= PAGE_SLAB){
+        if(!free_stack_push(k-PAGE_SLAB,p)){
+            lock
+            slab_free(k-PAGE_SLAB,p);
+            unlock
+        }
+        return;
+    }
+
+    // background thread is started once there's work for it
+    bg_start();
+
     // shift pointer back into memory block pointer
     memory_block* b = data_block(p);
 
-    lock
-    if(is_mmap_block(b)){
+    // released mmap block is cached and cache is checked for idle blocks once per decay step
+    if(k == PAGE_MMAP){
+        uint64_t now = heap_clock();
+        lock
         mmap_size -= b->size;
+        memory_block* l = mmap_cache_push(b,now);
+        if(l != null)
+            l->next = null;
+        if(!bg_active() && purge_step_of(now) != mmap_cache_step){
+            memory_block* d = mmap_cache_decay(now,false);
+            if(l != null)
+                l->next = d;
+            else
+                l = d;
+        }
+        unlock
+        mmap_unmap(l);
+        return;
+    }
+
+    // pointer isn't ours
+    if(k != PAGE_HEAP)
+        return;
+
+    lock
+
+    // small blocks are kept unmerged in quick lists
+    if(block_size(b) <= QUICK_MAX_SIZE){
+        quick_push(b);
         unlock
-        munmap(b,b->size);
         return;
     }
 
     // add removed block into freelist
-    add_block(b);
-
-    // give last memory block that isn't needed back to the operating system
-    b = freelist_end->prev;
-    if(block_end(b) == heap_end){
-        intptr_t inc = b->size;
-        if(inc >= GIVE_BACK_SIZE){
-            if(b == heap_start){
-                if(inc > GIVE_BACK_SIZE){
-                    inc = inc - GIVE_BACK_SIZE;
-                    sbrk(-inc);
-                    b->size = GIVE_BACK_SIZE;
-                }
-            }else{
-                block_unlink(b);
-                sbrk(-inc);
-                heap_size -= inc;
-                heap_end = shift_block_ptr(heap_end,-inc);
-                heap_start = shift_block_ptr(heap_end,-heap_size);
-            }
-        }
+    b = add_block(b);
+
+    // free pages are checked for purging once per decay step unless background thread does it
+    uint64_t now = heap_clock();
+    if(!bg_active() && purge_step_of(now) != purge_step){
+        freelist_purge(now,false);
+        heap_purge(now,false,0);
+    }
+
+    // give current chunk back to the operating system if it's empty
+    // quick lists are merged first as some of their blocks might be adjacent to top block
+    if(b != null && b == heap_top && heap_size > CHUNK_SIZE &&
+        heap_top_size + quick_size >= CHUNK_SIZE - sizeof(size_t)){
+        quick_consolidate();
+        shrink_heap();
     }
     unlock
 }
@@ -454,28 +1746,158 @@ void* calloc(size_t nmemb, size_t size){
     return p;
 }
 
+// give free pages back to the operating system now instead of letting them decay
+// first pad bytes of top block stay resident, 1 is returned if anything was given back
+int malloc_trim(size_t pad){
+    uint64_t now = heap_clock();
+    lock
+    quick_consolidate();
+    bool trimmed = freelist_purge(now,true);
+    size_t hs = heap_size;
+    shrink_heap();
+    trimmed |= hs != heap_size;
+    trimmed |= heap_purge(now,true,pad);
+    memory_block* l = mmap_cache_decay(now,true);
+    unlock
+    trimmed |= l != null;
+    mmap_unmap(l);
+    // work queued for background thread is done right away
+    bg_drain();
+    return trimmed;
+}
+
+// change tunables at run time, parameters are those of glibc that make sense here
+// M_MMAP_THRESHOLD sets mmap threshold and turns off its adjustment, 1 is returned on success
+int mallopt(int param, int value){
+    conf_load();
+    if(param == M_MMAP_THRESHOLD && value >= 0 && (size_t)value <= CHUNK_SIZE/2){
+        __atomic_store_n(&mmap_threshold_fixed,true,__ATOMIC_RELAXED);
+        __atomic_store_n(&mmap_threshold,(size_t)value,__ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+// debug output made while holding the lock is collected in a fixed buffer and printed
+// after unlocking as printf may need to malloc stdout buffer, output that doesn't fit is cut
+#define PRINT_BUFFER_SIZE 65536
+typedef struct {
+    size_t len;
+    char data[PRINT_BUFFER_SIZE];
+} print_buffer;
+
+// append formatted output to print buffer pb
+static void print_buffered(print_buffer* pb, const char* format, ...){
+    if(pb->len >= PRINT_BUFFER_SIZE - 1)
+        return;
+    va_list args;
+    va_start(args,format);
+    int n = vsnprintf(pb->data + pb->len,PRINT_BUFFER_SIZE - pb->len,format,args);
+    va_end(args);
+    if(n > 0)
+        pb->len = pb->len + n < PRINT_BUFFER_SIZE - 1 ? pb->len + n : PRINT_BUFFER_SIZE - 1;
+}
+
+// print and empty print buffer pb, lock must not be held
+static void print_flush(print_buffer* pb){
+    fwrite(pb->data,1,pb->len,stdout);
+    if(pb->len == PRINT_BUFFER_SIZE - 1)
+        printf(" -> output cut\n");
+    pb->len = 0;
+}
+
 void print_block_info(void* p){
     // shift pointer back into memory block pointer
     memory_block* b = data_block(p);
+    // header is copied under lock and printed after as printf may need to malloc stdout buffer
     lock
-    print_block(b);
+    memory_block h = *b;
     unlock
+    printf("block %p size %ld prev %p next %p\n",b,h.size,h.prev,h.next);
+}
+
+#ifdef HEAP_HUGEPAGE
+// bytes of heap chunks and slab region backed by huge pages as reported by /proc/self/smaps
+// file is parsed with plain read so that nothing is allocated meanwhile
+static size_t huge_size(){
+    int fd = open("/proc/self/smaps",O_RDONLY);
+    if(fd < 0)
+        return 0;
+    char buf[4096];
+    char line[256];
+    size_t n = 0, total = 0;
+    bool ours = false;
+    ssize_t r;
+    while((r = read(fd,buf,sizeof(buf))) > 0){
+        for(ssize_t i = 0; i < r; ++i){
+            if(buf[i] != '\n'){
+                if(n < sizeof(line) - 1)
+                    line[n++] = buf[i];
+                continue;
+            }
+            line[n] = 0;
+            n = 0;
+            char* e;
+            uint8_t* p = (uint8_t*)strtoul(line,&e,16);
+            if(*e == '-'){
+                // mapping header, fields that follow belong to this mapping
+                ours = heap_contains(p) || (p >= slab_region_start && p < slab_region_end);
+            }else if(ours && strncmp(line,"AnonHugePages:",14) == 0)
+                total += strtoul(line + 14,null,10)*1024;
+        }
+    }
+    close(fd);
+    return total;
 }
+#endif
 
 void print_freelist(){
+    print_buffer pb;
+    pb.len = 0;
+    // header is printed before locking as first printf may need to malloc stdout buffer
+    printf("[heap size %lu mb mmap_size %lu mb top size %lu kb, ",(heap_size/(1024*1024)),(mmap_size/(1024*1024)),heap_top == null ? 0 : heap_top_size/1024);
     lock
-    printf("[heap size %d mb mmap_size %d mb, ",(heap_size/(1024*1024)),(mmap_size/(1024*1024)));
-    printf("freelist {");
+    print_buffered(&pb,"index %lu|%lu, ",freelist_index.count-freelist_index.holes,freelist_index.holes);
+    print_buffered(&pb,"freelist {");
     memory_block* b = freelist_start;
     while(b != freelist_end){
-        printf(" -> %p[%lu|%p|%p]",b,b->size,b->prev,b->next);    
+        print_buffered(&pb," -> %p[%lu|%p|%p]",b,block_size(b),b->prev,b->next);
         // detect infinite loop if any
         if(b == b->next){
-            printf(" -> infinite loop\n");
+            print_buffered(&pb," -> infinite loop\n");
             break;
         }
         b = b->next;
     }
+    print_buffered(&pb," }\n");
+    print_buffered(&pb,"quick {");
+    for(uint8_t c = 0; c < QUICK_CLASS_COUNT; ++c){
+        unsigned int n = 0;
+        for(memory_block* b = quick_lists[c]; b != null; b = b->next)
+            ++n;
+        if(n > 0)
+            print_buffered(&pb," -> %lu[%u]",size_classes[c],n);
+    }
+    print_buffered(&pb," }\n");
+    print_buffered(&pb,"mmap threshold %lu kb%s mmap cache %lu mb hits %lu misses %lu {",mmap_threshold/1024,mmap_threshold_fixed ? " fixed" : "",mmap_cache_size/(1024*1024),mmap_cache_hits,mmap_cache_misses);
+    for(unsigned int c = 0; c < SIZE_CLASS_COUNT; ++c){
+        if(mmap_cache[c].count > 0)
+            print_buffered(&pb," -> %lu[%u]",size_classes[c],mmap_cache[c].count);
+    }
+    print_buffered(&pb," }\n");
+    print_buffered(&pb,"slabs {");
+    for(uint8_t c = 0; c < SLAB_CLASS_COUNT; ++c){
+        if(slab_count[c] > 0)
+            print_buffered(&pb," -> %lu[%u|%u|%u]",size_classes[c],slab_used[c],slab_count[c],free_stacks[c].head.count);
+    }
     unlock
+    print_flush(&pb);
     printf(" }\n");
+#ifdef LOCK_STATS
+    // counters are read without lock so they are only approximate
+    printf("lock [%lu|%lu|%lu]\n",heap_lock.acquired,heap_lock.contended,heap_lock.wait_time/1000);
+#endif
+#ifdef HEAP_HUGEPAGE
+    printf("huge pages %lu mb\n",huge_size()/(1024*1024));
+#endif
 }
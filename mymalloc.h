@@ -31,6 +31,15 @@ void* calloc(size_t nmemb, size_t size);
 void* malloc(size_t s);
 void* realloc(void* p, size_t ns);
 void free(void* p);
+int malloc_trim(size_t pad);
+// mallopt parameters, same values as glibc's
+#ifndef M_MMAP_THRESHOLD
+#define M_MMAP_THRESHOLD -3
+#endif
+#ifndef M_ARENA_MAX
+#define M_ARENA_MAX -8
+#endif
+int mallopt(int param, int value);
 // for debug use only
 void print_block_info(void* p);
 void print_freelist();
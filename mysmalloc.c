@@ -27,81 +27,443 @@ THE SOFTWARE.
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
 #include <mymalloc.h>
 #include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
 #include <sys/mman.h>
 #include <linux/mman.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 // for code clarity for pointers we use null instead of 0
 #define null 0
 
 // initial values
 #define PAGE_SIZE (sysconf(_SC_PAGESIZE))
-#define MIN_BLOCK_SIZE 32 // bytes
-#define ALLOC_SIZE 33554432 // 32 MiB or 8192 pages if page size is 4096
-#define GIVE_BACK_SIZE 33554432 // 32 MiB or 8192 pages if page size is 4096
-#define MMAP_SIZE 1048576 // 1 MiB or 1024 pages if page size is 4096
+#define MIN_BLOCK_SIZE 48 // bytes
+#define CHUNK_SIZE 33554432 // 32 MiB, heap chunk size, power of 2 at least twice MMAP_THRESHOLD_MAX
+#define HEAP_RESERVE_SIZE 4398046511104 // 4 TiB of address space reserved for heap chunks, heap can't grow past it
+/* #define HEAP_HUGEPAGE 1 */ // ask for heap chunks and slab region to be backed by transparent huge pages
+#define HUGE_PAGE_SIZE 2097152 // 2 MiB, chunks and slab region are aligned to it
+#define MMAP_SIZE 1048576 // 1 MiB or 1024 pages if page size is 4096, initial mmap threshold
+#define MMAP_THRESHOLD_MAX 16777216 // 16 MiB, mmap threshold rises up to this as mmap blocks are freed
+#define MMAP_CACHE_SIZE 134217728 // 128 MiB, released mmap blocks kept mapped for reuse
+#define MMAP_CACHE_DEPTH 4 // released mmap blocks of a single size class kept mapped
+/* #define BACKGROUND_THREAD 1 */ // unmap, purge and merge in a background thread instead of freeing threads
+#define BACKGROUND_PENDING 268435456 // 256 MiB, queued for background thread before freeing threads unmap themselves
+/* #define HEAP_PREDICT 1 */ // grow heap ahead of demand based on rate it's used at
+#define HEAP_PREDICT_TIME 100000000 // ns, heap grown ahead of demand should last this long
+#define PURGE_DECAY_TIME 10000000000 // ns, pages of free blocks are given back gradually over this time
+#define PURGE_STEPS 10 // decay steps, free pages are checked once per step
+/* #define PURGE_LAZY 1 */ // purge with MADV_FREE so kernel takes pages only under memory pressure
 #define MERGE_ADJ_ON_REALLOC 1 // try to merge with adjacent blocks on realloc
+#define SLAB_SIZE 4096 // bytes, each slab holds objects of a single size class
+#define SLAB_MAX_SIZE 1024 // bytes, sizes up to this are allocated from slabs
+#define SLAB_REGION_SIZE 1073741824 // 1 GiB of address space reserved for slabs
+#define CACHE_LINE_SIZE 64 // bytes, shared metadata is padded to it
+#define LOCK_SPIN 100 // times busy lock is checked before waiting thread goes to sleep
+/* #define LOCK_STATS 1 */ // count lock acquisitions and time spent waiting for locks
+#define FREE_STACK_DEPTH 128 // freed objects of a single slab size class kept in lock free stack
+#define QUICK_MAX_SIZE 16384 // bytes, freed blocks up to this size are kept in quick lists unmerged
+#define INDEX_INIT_SIZE 512 // free blocks, initial capacity of freelist index
+#define CACHE_MAX_SIZE 16384 // bytes, objects and blocks up to this size are cached per thread or cpu
+#define TCACHE_DEPTH 16 // objects of a single size class kept in thread cache
+#define CACHE_BATCH 8 // objects moved between thread or cpu cache and shared lists at once
+/* #define CPU_CACHE 1 */ // uncomment to use per cpu caches instead of per thread caches
+#define CPU_CACHE_DEPTH 64 // objects of a single size class kept in cpu cache
+
+// tunables
+// initial values above are defaults that can be changed at run time, they are read once
+// on first use from MYMALLOC_CONF environment variable as comma separated key:value
+// pairs, e.g. MYMALLOC_CONF=mmap_threshold:4194304,decay_ms:1000. keys are
+// min_block_size, mmap_threshold, mmap_threshold_max, mmap_cache_size, decay_ms,
+// merge_adj_on_realloc and freelists, unknown ones are ignored. mallopt can change some
+// of them later.
+// mmap threshold is adjusted when a request misses mmap cache while a block of its size
+// class was unmapped within decay time, the threshold rises past it so that blocks of that
+// size allocated and freed repeatedly are cut from heap instead of being mapped and unmapped
+// every time. setting mmap_threshold in either way turns adjustment off
+static size_t min_block_size = MIN_BLOCK_SIZE;
+static size_t mmap_threshold = MMAP_SIZE;
+static size_t mmap_threshold_max = MMAP_THRESHOLD_MAX;
+static bool mmap_threshold_fixed = false; // threshold was set explicitly and isn't adjusted
+static size_t mmap_cache_max = MMAP_CACHE_SIZE;
+static uint64_t purge_decay_time = PURGE_DECAY_TIME;
+#ifdef MERGE_ADJ_ON_REALLOC
+static bool merge_adj_on_realloc = true;
+#else
+static bool merge_adj_on_realloc = false;
+#endif
+static uint32_t freelist_max = 0; // freelists to use, 0 for one per online cpu
+static bool conf_ready = false;
 
 // memory block structure
 typedef struct memory_block_t {
     size_t size;
     struct memory_block_t* prev;
     struct memory_block_t* next;
+    size_t slot; // position of free block in freelist index
+    uint64_t stamp; // time free block was last freed, 0 once its pages are purged
 } memory_block;
 
-// free memory block list
-#define FREELIST_SIZE 8 // number of freelists
-static memory_block freelists[] = {
-    { 0, null, &(freelists[1]) },  { 0, &(freelists[0]), null},
-    { 0, null, &(freelists[3]) },  { 0, &(freelists[2]), null},
-    { 0, null, &(freelists[5]) },  { 0, &(freelists[4]), null},
-    { 0, null, &(freelists[7]) },  { 0, &(freelists[6]), null},
-    { 0, null, &(freelists[9]) },  { 0, &(freelists[8]), null},
-    { 0, null, &(freelists[11]) }, { 0, &(freelists[10]), null},
-    { 0, null, &(freelists[13]) }, { 0, &(freelists[12]), null},
-    { 0, null, &(freelists[15]) }, { 0, &(freelists[14]), null},
-};
+// block tags kept in upper bits of size
+// free block is tagged with 1 + index of the freelist it belongs to and its right adjacent
+// block is tagged with the same value so that left adjacent free block can be found and
+// merged without walking freelist, free blocks also keep their size in the last size_t of
+// the block (footer). tags are only trusted by the holder of the tagged freelist's lock
+#define BLOCK_SIZE_MASK 0x0000ffffffffffffUL
+#define BLOCK_FREE_SHIFT 48 // block is free in freelist
+#define BLOCK_PREV_FREE_SHIFT 56 // left adjacent block is free in freelist
+#define BLOCK_FREE_MASK (0xffUL << BLOCK_FREE_SHIFT)
+#define BLOCK_PREV_FREE_MASK (0xffUL << BLOCK_PREV_FREE_SHIFT)
+#define BLOCK_TOP_TAG 0xffUL // free tag of the top block
+
+// free memory block lists
+// every thread has a home freelist it allocates from and frees to, other freelists are
+// only used when home freelist can't satisfy the request. number of freelists is found
+// from the number of online cpus on first use
+#define FREELIST_SIZE 64 // max number of freelists
+#define FREELIST_NONE 0xff // thread has no home freelist yet
+static memory_block freelists[FREELIST_SIZE*2] __attribute__((aligned(CACHE_LINE_SIZE))); // start and end of every freelist
+static uint32_t freelist_count = 0; // number of freelists in use
+static uint32_t freelist_next = 0; // home freelist of the next thread
+static __thread uint8_t freelist_home = FREELIST_NONE;
 #define freelist_start(i) (freelists[0+i].next)
 #define freelist_begin(i) (&(freelists[0+i]))
 #define freelist_end(i) (&(freelists[1+i]))
+#define freelist_tag(i) ((size_t)(i/2+1))
+#define tag_freelist(t) ((uint8_t)((t-1)*2))
+
+// freelist index
+// sizes and addresses of free blocks are also kept in contiguous arrays so that freelist
+// can be searched with vector instructions without touching the blocks themselves.
+// blocks are appended in the order they are added to freelist and removed ones leave
+// a hole of size 0 until index is compacted, search goes from the end so it finds
+// the same block as walking freelist from its start would. index is guarded by its freelist lock
+#define INDEX_NONE ((size_t)-1) // block is not in freelist index
+typedef struct {
+    size_t* sizes;
+    memory_block** blocks;
+    size_t count; // slots in use including holes
+    size_t holes;
+    size_t capacity;
+} block_index;
+#define freelist_index(i) (&(freelist_states[i/2].index))
 
 // heap
-static memory_block* heap_start = null;
-static memory_block* heap_end = null;
-static uint32_t heap_size;
-static uint32_t mmap_size;
+// heap is a set of chunks allocated with mmap and aligned to CHUNK_SIZE. every chunk ends
+// with a fence, header of a used block of size 0, so that blocks never merge across chunks
+// and the right adjacent block of any heap block is always a valid block header.
+// current chunk ends with top block that is never in freelist, fresh memory is cut from
+// its start and blocks freed next to it are merged back into it. top block might be empty
+// in which case fence is its header. top block is tagged with BLOCK_TOP_TAG and owned by
+// the holder of global lock. chunk that becomes a single free block is unmapped
+static memory_block* heap_end = null; // fence of current chunk
+static memory_block* heap_top = null;
+#ifdef HEAP_PREDICT
+static memory_block* heap_spare = null; // chunk mapped ahead of demand
+#endif
+static size_t heap_size; // bytes in chunks
+static size_t mmap_size; // bytes in mmap blocks in use, guarded by mmap lock
+static uint32_t heap_growing = 0; // set while some thread grows heap, waiters sleep on it
+static uint64_t heap_top_stamp = 0; // time block was last merged into top block, 0 once its pages are purged
+#ifdef HEAP_PREDICT
+static size_t heap_cut = 0; // bytes cut from top block and not merged back since heap last grew
+static uint64_t heap_grown_at = 0; // time heap last grew in ns
+#endif
+
+// heap reservation
+// chunks are committed from a single range of address space reserved on first use so that
+// heap pointers are classified with a range check. chunks given back are decommitted and
+// their slots are reused before the rest of the reservation
+#define HEAP_RESERVE_WORDS ((HEAP_RESERVE_SIZE/CHUNK_SIZE + 63)/64)
+static uint8_t* heap_reserve_start = null;
+static uint8_t* heap_reserve_end = null;
+static uint8_t* heap_reserve_top = null; // first never committed chunk slot
+static uint64_t heap_reserve_free[HEAP_RESERVE_WORDS]; // bitmap of decommitted chunk slots
+#define heap_contains(p) ((uint8_t*)(p) >= heap_reserve_start && (uint8_t*)(p) < heap_reserve_end)
+
+// page map
+// radix tree from page number to what the page is used for so that any pointer given
+// to free or realloc is classified without touching the memory it points to.
+// 48 bit address space of 4 KiB pages is split into 3 levels of 12 bits, nodes are
+// allocated with mmap when pages under them are first used
+#define PAGE_MAP_SHIFT 12 // log2 of page size tracked by page map
+#define PAGE_MAP_BITS 12 // bits of page number for every level
+#define PAGE_MAP_LEN (1UL << PAGE_MAP_BITS)
+#define PAGE_MAP_MASK (PAGE_MAP_LEN - 1)
+#define PAGE_MAP_PAGE (1UL << PAGE_MAP_SHIFT)
+#define PAGE_NONE 0 // page isn't ours
+#define PAGE_HEAP 1 // page of heap chunk, found by range check and never set in page map
+#define PAGE_MMAP 2 // first page of mmap block
+#define PAGE_SLAB 3 // slab page, size class of the slab is added to it
+typedef uint8_t page_map_leaf[PAGE_MAP_LEN];
+typedef page_map_leaf* page_map_node[PAGE_MAP_LEN];
+static page_map_node* page_map[PAGE_MAP_LEN];
+
+// slab structure
+// small objects have no header, slabs are carved from a reserved region
+// and slab of an object is found from object address
+typedef struct slab_t {
+    struct slab_t* prev;
+    struct slab_t* next;
+    void* free; // freed objects list
+    struct slab_owner_t* owner; // cache carving objects from the slab, null if it's shared
+    uint32_t top; // offset of first never used object
+    uint32_t used; // objects in use
+    uint32_t size; // object size
+} __attribute__((aligned(CACHE_LINE_SIZE))) slab;
+
+#define SLAB_CLASS_COUNT 20 // size classes up to SLAB_MAX_SIZE
+
+// slabs
+static uint8_t* slab_region_start = null;
+static uint8_t* slab_region_end = null;
+static uint8_t* slab_region_top = null;
+static slab* slabs = null; // slab descriptors, one for every SLAB_SIZE of region
+static slab* slab_empty = null; // empty slabs that can be reused by any size class
+
+// size class shared slab list guarded by size class lock, stats are updated atomically
+typedef struct {
+    slab* partial; // shared slabs with free objects
+    uint32_t count;
+    uint32_t used;
+} __attribute__((aligned(CACHE_LINE_SIZE))) slab_class;
+static slab_class slab_classes[SLAB_CLASS_COUNT];
+
+#define ptr_slab(p) (&(slabs[(byte_ptr(p) - slab_region_start)/SLAB_SIZE]))
+#define slab_start(sl) (slab_region_start + (sl - slabs)*SLAB_SIZE)
+#define slab_full(sl) (sl->free == null && sl->top + sl->size > SLAB_SIZE)
+
+// free stacks
+// freed slab objects are kept in lock free Treiber stacks per size class so that small
+// objects are allocated and freed without waiting for a lock holder. top of the stack,
+// a tag that changes on every push and pop and object count are swapped together with
+// double width CAS so that pop with stale next pointer can't succeed (ABA). objects in
+// stacks are still counted as used by their slabs and slab memory is never unmapped so
+// next pointer of an object can always be read even if it was popped meanwhile
+typedef union {
+    struct {
+        void* top;
+        uint32_t tag;
+        uint32_t count;
+    };
+    unsigned __int128 word;
+} __attribute__((aligned(16))) free_stack_head;
+typedef struct {
+    free_stack_head head;
+} __attribute__((aligned(CACHE_LINE_SIZE))) free_stack;
+static free_stack free_stacks[SLAB_CLASS_COUNT];
+
+// double width CAS needs cmpxchg16b on x86
+#if defined(__x86_64__)
+#define FREE_STACK_CAS __attribute__((target("cx16")))
+#else
+#define FREE_STACK_CAS
+#endif
 
-// mmap
-#define is_mmap_block(b) (!(heap_start <= b && b < heap_end))
+// quick lists
+// freed blocks that are small enough are pushed to the quick list of their size class
+// without merging, they stay marked as used so adjacent blocks don't merge with them.
+// every freelist has its own quick lists guarded by its lock, they are merged into
+// the freelist in one go when malloc can't find a block or heap is trimmed
+#define QUICK_CLASS_COUNT 36 // size classes up to QUICK_MAX_SIZE
+
+// freelist state guarded by freelist lock
+// every freelist has its own cache lines so that holders of different freelists don't
+// invalidate each other's lines
+typedef struct {
+    memory_block* quick_lists[QUICK_CLASS_COUNT];
+    size_t quick_size; // bytes held in quick lists
+    uint32_t unmerged; // blocks added next to free blocks of other freelists
+    block_index index;
+    uint64_t purge_step; // decay step free pages were last checked at
+    uint64_t freed_step; // decay step of the newest purge_freed entry
+    size_t purge_freed[PURGE_STEPS]; // bytes freed in last decay steps
+} __attribute__((aligned(CACHE_LINE_SIZE))) freelist_state;
+static freelist_state freelist_states[FREELIST_SIZE];
+
+// remote free queues
+// block freed while the lock of its freelist is held by another thread is pushed to
+// the remote free queue of that freelist with a single atomic exchange instead of
+// waiting for the lock. whoever takes the freelist lock next drains the queue.
+// queue is intrusive multi producer single consumer list linked through next field
+// of blocks, stub block keeps it non empty so producers never touch the tail
+typedef struct {
+    memory_block* head; // last pushed block, exchanged by producers
+    memory_block* tail; // next block to drain, freelist lock must be held
+    memory_block stub;
+} __attribute__((aligned(CACHE_LINE_SIZE))) remote_queue;
+static remote_queue remote_queues[FREELIST_SIZE];
+
+// adaptive lock
+// lock word is 0 when unlocked, 1 when locked and 2 when locked and some thread
+// might be sleeping on it. waiter spins reading the word for a short while before trying
+// to take it again and then sleeps on futex until unlock wakes it up. every lock has its
+// own cache line so that taking one doesn't invalidate the others
+typedef struct {
+    volatile uint32_t word;
+#ifdef LOCK_STATS
+    // updated by lock holder
+    uint64_t acquired; // times lock was taken
+    uint64_t contended; // times lock was taken after waiting for it
+    uint64_t wait_time; // total time spent waiting in ns
+#endif
+} __attribute__((aligned(CACHE_LINE_SIZE))) alock;
+
+#define CACHE_CLASS_COUNT 36 // size classes up to CACHE_MAX_SIZE
+
+// slab owner
+// every thread or cpu cache owns the slabs it carves objects from so that objects sharing
+// a cache line are handed to one cache only. owner keeps its slabs in its own lists and
+// carves and frees their objects without taking size class lock. object freed by any other
+// thread is pushed to remote list of the owner with a single CAS and owner takes the list
+// as a whole when it refills. records are never unmapped so that a late push can't write
+// to freed memory, record of exited thread is reused by a new one that drains it
+typedef struct slab_owner_t {
+    slab* partial[SLAB_CLASS_COUNT]; // owned slabs with free objects
+    slab* full[SLAB_CLASS_COUNT]; // owned slabs without free objects
+    struct slab_owner_t* next; // next unused record
+    // pushed by other threads so kept off the lines the owner writes
+    void* remote[SLAB_CLASS_COUNT] __attribute__((aligned(CACHE_LINE_SIZE)));
+#ifdef CPU_CACHE
+    alock lock; // any thread running on the cpu might use its slabs
+#endif
+} __attribute__((aligned(CACHE_LINE_SIZE))) slab_owner;
+
+#ifdef CPU_CACHE
+// cpu cache
+// instead of every thread every cpu keeps recently freed slab objects and heap blocks
+// in arrays per size class so that cached memory grows with cpus and not with threads.
+// arrays of the current cpu are changed in restartable sequences that kernel aborts
+// if thread is preempted or migrated so that no atomics are needed. without rseq the
+// cpu is found with sched_getcpu and its cache is locked. every cpu carves slab objects
+// from slabs it owns and objects freed on other cpus are pushed back to their owner
+#define RSEQ_SIG "0x53053053" // signature glibc registers rseq with on x86
+typedef struct {
+    uint32_t count[CACHE_CLASS_COUNT];
+    alock lock; // only used without rseq
+    void* slots[CACHE_CLASS_COUNT][CPU_CACHE_DEPTH];
+    slab_owner owner; // slabs objects are carved from
+} cpu_cache;
+static cpu_cache* cpu_caches = null;
+static uint32_t cpu_count;
+
+// rseq area registered by glibc for every thread
+typedef struct {
+    uint32_t cpu_id_start;
+    uint32_t cpu_id;
+    uint64_t rseq_cs;
+    uint32_t flags;
+} rseq_area;
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+#else
+// thread cache
+// every thread keeps recently freed slab objects and heap blocks in lists per size class
+// so that common malloc and free don't take any locks. size classes of slabs are used for
+// slab objects and size classes above them for heap blocks. objects are moved between
+// thread cache and slabs or quick lists in batches, heap blocks in it stay marked as used.
+// every thread carves slab objects from slabs it owns and objects freed by other threads are
+// pushed back to it, so that objects sharing a cache line are never handed to two threads
+#define TCACHE_NONE 0 // thread cache wasn't used yet
+#define TCACHE_INIT 1 // thread cache is being set up
+#define TCACHE_ACTIVE 2
+#define TCACHE_DEAD 3 // thread is exiting and its cache was flushed or cache couldn't be set up
+typedef struct {
+    void* head[CACHE_CLASS_COUNT]; // objects are linked through their first word
+    uint32_t count[CACHE_CLASS_COUNT];
+    slab_owner* owner; // slabs objects are carved from
+    uint8_t state;
+} thread_cache;
+static __thread thread_cache tcache;
+#define SLAB_OWNER_BATCH 64 // owner records mapped at once
+static slab_owner* slab_owners_unused = null; // records of exited threads, global lock
+static pthread_key_t tcache_key; // flushes thread cache on thread exit
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+#endif
 
 // locking
-volatile bool glob_lock = false;
-volatile bool freelist_locks[] = { false, false, false, false, false, false, false, false };
-
-static inline void lock(volatile bool* lock){
-    if (!__sync_bool_compare_and_swap(lock, 0, 1)){
-        int i = 0;
-        do {
-            if (__sync_bool_compare_and_swap(lock, 0, 1))
-                break;
-            else{
-                if(i == 10){
-                    i = 0;
-                    sched_yield();
-                }else
-                    ++i;
-            }
-        } while (1);
+static alock glob_lock;
+static alock freelist_locks[FREELIST_SIZE];
+static alock slab_locks[SLAB_CLASS_COUNT]; // size class slab lists and stats
+static alock slab_pool_lock; // slab region and empty slabs
+static alock mmap_lock; // mmap blocks stats and mmap cache
+
+#if defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
+#define futex_wait(w,v) syscall(SYS_futex,w,FUTEX_WAIT_PRIVATE,v,null,null,0)
+#define futex_wake(w,n) syscall(SYS_futex,w,FUTEX_WAKE_PRIVATE,n,null,null,0)
+
+#ifdef LOCK_STATS
+static inline uint64_t lock_clock(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000UL + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+// take lock only if it's unlocked
+static inline bool trylock(alock* l){
+    if(l->word != 0 || !__sync_bool_compare_and_swap(&(l->word),0,1))
+        return false;
+#ifdef LOCK_STATS
+    ++l->acquired;
+#endif
+    return true;
+}
+
+// wait for lock held by another thread
+static void lock_wait(alock* l){
+#ifdef LOCK_STATS
+    uint64_t t = lock_clock();
+#endif
+    uint32_t w = 0;
+    for(int i = 0; i < LOCK_SPIN; ++i){
+        cpu_relax();
+        w = l->word;
+        if(w == 0 && __sync_bool_compare_and_swap(&(l->word),0,1))
+            goto locked;
+        // someone is already sleeping so there is no point to keep spinning
+        if(w == 2)
+            break;
     }
+    // mark lock as having sleepers, if it was unlocked meanwhile we own it
+    while(__atomic_exchange_n(&(l->word),2,__ATOMIC_ACQUIRE) != 0)
+        futex_wait(&(l->word),2);
+locked:
+#ifdef LOCK_STATS
+    ++l->acquired;
+    ++l->contended;
+    l->wait_time += lock_clock() - t;
+#endif
+    return;
+}
+
+static inline void lock(alock* l){
+    if(!trylock(l))
+        lock_wait(l);
 }
 
-#define unlock(lock) \
-    __asm__ __volatile__ ("" ::: "memory"); \
-    *lock = 0
+static inline void unlock(alock* l){
+    // only wake up sleepers if there might be any
+    if(__atomic_exchange_n(&(l->word),0,__ATOMIC_RELEASE) == 2)
+        futex_wake(&(l->word),1);
+}
 
 #define global_lock() \
     lock(&glob_lock)
@@ -109,63 +471,131 @@ static inline void lock(volatile bool* lock){
 #define global_unlock() \
     unlock(&glob_lock)
 
-// find unlocked freelist that is not fj
-static inline uint8_t freelist_lock(uint8_t fj){
-    int j = 0;
-    while(1){
-        for(uint8_t i = 0; i < FREELIST_SIZE; ++i){
-            if(fj == i*2)
-                continue;
-            if (__sync_bool_compare_and_swap(&(freelist_locks[i]), 0, 1)){
-                return i*2;
+// key k of length n is name
+#define conf_key(k,n,name) ((n) == sizeof(name) - 1 && strncmp(k,name,n) == 0)
+
+// read tunables from MYMALLOC_CONF and bring them into range
+// nothing is allocated meanwhile as it's done on first malloc
+static void conf_init(){
+    global_lock();
+    if(!conf_ready){
+        const char* c = getenv("MYMALLOC_CONF");
+        while(c != null && *c != 0){
+            const char* e = strchr(c,',');
+            if(e == null)
+                e = c + strlen(c);
+            const char* v = memchr(c,':',e - c);
+            char* ve = null;
+            size_t x = v != null ? strtoul(v + 1,&ve,0) : 0;
+            // pairs without a number are ignored
+            if(v != null && ve != v + 1){
+                size_t n = v - c;
+                if(conf_key(c,n,"min_block_size"))
+                    min_block_size = x;
+                else if(conf_key(c,n,"mmap_threshold")){
+                    mmap_threshold = x;
+                    mmap_threshold_fixed = true;
+                }else if(conf_key(c,n,"mmap_threshold_max"))
+                    mmap_threshold_max = x;
+                else if(conf_key(c,n,"mmap_cache_size"))
+                    mmap_cache_max = x;
+                else if(conf_key(c,n,"decay_ms"))
+                    purge_decay_time = x*1000000;
+                else if(conf_key(c,n,"merge_adj_on_realloc"))
+                    merge_adj_on_realloc = x != 0;
+                else if(conf_key(c,n,"freelists"))
+                    freelist_max = x > FREELIST_SIZE ? FREELIST_SIZE : x;
             }
+            c = *e == ',' ? e + 1 : e;
         }
-        ++j;
-        if(j == 10){
-            j = 0;
-            sched_yield();
-        }
+        // blocks must hold free block header and footer
+        if(min_block_size < MIN_BLOCK_SIZE)
+            min_block_size = MIN_BLOCK_SIZE;
+        if(min_block_size > QUICK_MAX_SIZE)
+            min_block_size = QUICK_MAX_SIZE;
+        min_block_size = (min_block_size + 15) & ~15UL;
+        // heap blocks must fit into a chunk
+        if(mmap_threshold_max > CHUNK_SIZE/2)
+            mmap_threshold_max = CHUNK_SIZE/2;
+        if(mmap_threshold > mmap_threshold_max)
+            mmap_threshold = mmap_threshold_max;
+        if(purge_decay_time < 1000000)
+            purge_decay_time = 1000000;
+        __atomic_store_n(&conf_ready,true,__ATOMIC_RELEASE);
     }
+    global_unlock();
 }
 
-static inline uint8_t freelist_lock_any(){
-    int j = 0;
-    while(1){
-        for(uint8_t i = 0; i < FREELIST_SIZE; ++i){
-            if (__sync_bool_compare_and_swap(&(freelist_locks[i]), 0, 1)){
-                return i*2;
-            }
-        }
-        ++j;
-        if(j == 10){
-            j = 0;
-            sched_yield();
+static inline void conf_load(){
+    if(!__atomic_load_n(&conf_ready,__ATOMIC_ACQUIRE))
+        conf_init();
+}
+
+// set up freelists and their remote free queues
+static void freelists_init(){
+    conf_load();
+    global_lock();
+    if(freelist_count == 0){
+        long n = freelist_max > 0 ? (long)freelist_max : sysconf(_SC_NPROCESSORS_ONLN);
+        if(n < 1)
+            n = 1;
+        if(n > FREELIST_SIZE)
+            n = FREELIST_SIZE;
+        for(long i = 0; i < n; ++i){
+            freelists[i*2].next = &(freelists[i*2+1]);
+            freelists[i*2+1].prev = &(freelists[i*2]);
+            remote_queues[i].head = &(remote_queues[i].stub);
+            remote_queues[i].tail = &(remote_queues[i].stub);
         }
+        __atomic_store_n(&freelist_count,(uint32_t)n,__ATOMIC_RELEASE);
     }
+    global_unlock();
 }
 
-static inline void freelist_lock_all(){
-    int j = 0;
-    for(uint8_t i = 0; i < FREELIST_SIZE; ++i){
-        while(1){
-            if (__sync_bool_compare_and_swap(&(freelist_locks[i]), 0, 1)){
-                ++i;
-                break;
-            }
-            ++j;
-            if(j == 10){
-                j = 0;
-                sched_yield();
-            }
-        }
+// find home freelist of current thread, threads get them in round robin order
+static inline uint8_t home_freelist(){
+    if(freelist_home == FREELIST_NONE){
+        if(__atomic_load_n(&freelist_count,__ATOMIC_ACQUIRE) == 0)
+            freelists_init();
+        freelist_home = (uint8_t)((__sync_fetch_and_add(&freelist_next,1) % freelist_count)*2);
     }
+    return freelist_home;
+}
+
+static inline void freelist_lock_all(){
+    for(uint8_t i = 0; i < freelist_count; ++i)
+        lock(&(freelist_locks[i]));
 }
 
+#define lock_freelist(fi) \
+    lock(&(freelist_locks[fi/2]))
+
 #define unlock_freelist(fi) \
     unlock(&(freelist_locks[fi/2]))
 
+#define trylock_freelist(fi) \
+    trylock(&(freelist_locks[fi/2]))
+
+#define lock_slab_class(c) \
+    lock(&(slab_locks[c]))
+
+#define unlock_slab_class(c) \
+    unlock(&(slab_locks[c]))
+
+#define lock_slab_pool() \
+    lock(&slab_pool_lock)
+
+#define unlock_slab_pool() \
+    unlock(&slab_pool_lock)
+
+#define lock_mmap() \
+    lock(&mmap_lock)
+
+#define unlock_mmap() \
+    unlock(&mmap_lock)
+
 #define unlock_all_freelists() \
-    for(uint8_t i = 0; i < FREELIST_SIZE; ++i){ \
+    for(uint8_t i = 0; i < freelist_count; ++i){ \
         unlock(&(freelist_locks[i])); \
     }
 
@@ -179,7 +609,16 @@ static inline void freelist_lock_all(){
 #define shift_block_ptr(b,s) ((memory_block*)(shift_ptr(b,s)))
 #define block_data(b) (shift_ptr(b,+sizeof(size_t)))
 #define data_block(p) (shift_block_ptr(p,-sizeof(size_t)))
-#define block_end(b) (shift_block_ptr(b,+b->size))
+#define block_size(b) (b->size & BLOCK_SIZE_MASK)
+#define block_free_tag(b) ((b->size & BLOCK_FREE_MASK) >> BLOCK_FREE_SHIFT)
+#define block_prev_free_tag(b) ((b->size & BLOCK_PREV_FREE_MASK) >> BLOCK_PREV_FREE_SHIFT)
+#define block_end(b) (shift_block_ptr(b,+block_size(b)))
+#define block_footer(b) (*((size_t*)shift_ptr(b,+block_size(b)-sizeof(size_t))))
+#define block_left(b) (shift_block_ptr(b,-*((size_t*)shift_ptr(b,-sizeof(size_t)))))
+#define heap_top_size ((size_t)(byte_ptr(heap_end) - byte_ptr(heap_top)))
+#define chunk_start(b) ((memory_block*)((uintptr_t)(b) & ~((uintptr_t)CHUNK_SIZE - 1)))
+#define chunk_fence(c) (shift_block_ptr(c,+(CHUNK_SIZE - sizeof(size_t))))
+#define chunk_free(b) (b == chunk_start(b) && block_size(b) == CHUNK_SIZE - sizeof(size_t))
 
 #define block_link(lb,rb) \
     rb->prev = lb; \
@@ -209,329 +648,2290 @@ static inline void print_block(memory_block* b){
     printf("block %p size %ld prev %p next %p\n",b,b->size,b->prev,b->next);
 }
 
-// add block to free list
-static inline void add_block(uint8_t fi, memory_block* block){
-    if(freelist_start(fi) != freelist_end(fi)){
-        // find superseding memory block
-        // and insert current one before it
-        memory_block* b = freelist_start(fi);
-        while(1){
-            // superseding memory block will have higher memory address
-            if(b > block){
-                block_link_left(block,b);
-                break;
-            }
-            // check if we hit end
-            if(b->next == freelist_end(fi)){
-                block_link_right(b,block);
-                break;
-            }else{
-                b = b->next;
-            }
+// update bits of block header selected by mask
+// header might be concurrently updated by the holder of left adjacent block so it's done atomically
+static inline void block_update(memory_block* b, size_t mask, size_t v){
+    size_t o = b->size;
+    size_t n;
+    while((n = __sync_val_compare_and_swap(&(b->size), o, (o & ~mask) | v)) != o)
+        o = n;
+}
+
+// get page map entry of page containing p
+static inline uint8_t page_map_get(void* p){
+    uintptr_t n = (uintptr_t)p >> PAGE_MAP_SHIFT;
+    if(n >> (3*PAGE_MAP_BITS))
+        return PAGE_NONE;
+    page_map_node* node = page_map[n >> (2*PAGE_MAP_BITS)];
+    if(node == null)
+        return PAGE_NONE;
+    page_map_leaf* leaf = (*node)[(n >> PAGE_MAP_BITS) & PAGE_MAP_MASK];
+    if(leaf == null)
+        return PAGE_NONE;
+    return (*leaf)[n & PAGE_MAP_MASK];
+}
+
+// set page map entry of every page overlapping s bytes at p to v
+// entries are only set by the owner of the pages, missing nodes might be added concurrently
+static inline bool page_map_set(void* p, size_t s, uint8_t v){
+    uintptr_t n = (uintptr_t)p >> PAGE_MAP_SHIFT;
+    uintptr_t e = ((uintptr_t)p + s - 1) >> PAGE_MAP_SHIFT;
+    if(e >> (3*PAGE_MAP_BITS))
+        return false;
+    while(n <= e){
+        page_map_node** node = &(page_map[n >> (2*PAGE_MAP_BITS)]);
+        if(*node == null){
+            void* m = mmap(NULL,sizeof(page_map_node),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+            if(m == MAP_FAILED)
+                return false;
+            // node might have been added by other thread meanwhile
+            if(!__sync_bool_compare_and_swap(node,null,(page_map_node*)m))
+                munmap(m,sizeof(page_map_node));
         }
+        page_map_leaf** leaf = &((**node)[(n >> PAGE_MAP_BITS) & PAGE_MAP_MASK]);
+        if(*leaf == null){
+            void* m = mmap(NULL,sizeof(page_map_leaf),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+            if(m == MAP_FAILED)
+                return false;
+            if(!__sync_bool_compare_and_swap(leaf,null,(page_map_leaf*)m))
+                munmap(m,sizeof(page_map_leaf));
+        }
+        // pages up to the end of this leaf are set at once
+        uintptr_t le = n | PAGE_MAP_MASK;
+        if(le > e)
+            le = e;
+        memset(&((**leaf)[n & PAGE_MAP_MASK]),v,le - n + 1);
+        n = le + 1;
+    }
+    return true;
+}
 
-        // merge adjacent blocks
-        bool merged = true;
-        while(merged){
-            // merge right adjacent block
-            if(block_end(block) == block->next){
-                block->size += block->next->size;
-                block_unlink_right(block);
-                continue;
+// make room for one more block in freelist index
+// holes are squeezed out if there are enough of them otherwise index is grown
+static inline bool index_reserve(block_index* ix){
+    if(ix->count < ix->capacity)
+        return true;
+    if(ix->holes > 0 && ix->holes >= ix->count/4){
+        size_t j = 0;
+        for(size_t i = 0; i < ix->count; ++i){
+            if(ix->sizes[i] != 0){
+                ix->sizes[j] = ix->sizes[i];
+                ix->blocks[j] = ix->blocks[i];
+                ix->blocks[j]->slot = j;
+                ++j;
             }
-            // merge left adjacent block
-            if(block_end(block->prev) == block){
-                block = block->prev;
-                block->size += block->next->size;
-                block_unlink_right(block);
-                continue;
-            }
-            merged = false;
         }
-    }else{
-        // add first memory block
-        memory_block* b = freelist_begin(fi);
-        block_link_right(b, block);
+        ix->count = j;
+        ix->holes = 0;
+        return true;
     }
+    // sizes and addresses share one mapping, addresses follow sizes
+    size_t capacity = ix->capacity == 0 ? INDEX_INIT_SIZE : ix->capacity*2;
+    void* m;
+    if(ix->capacity == 0)
+        m = mmap(NULL,capacity*2*sizeof(size_t),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    else
+        m = mremap(ix->sizes,ix->capacity*2*sizeof(size_t),capacity*2*sizeof(size_t),MREMAP_MAYMOVE);
+    if(m == MAP_FAILED)
+        return false;
+    ix->sizes = (size_t*)m;
+    memmove(ix->sizes+capacity,ix->sizes+ix->capacity,ix->count*sizeof(memory_block*));
+    ix->blocks = (memory_block**)(ix->sizes+capacity);
+    ix->capacity = capacity;
+    return true;
 }
 
-// split memory block into 2 pieces one of size s and the other is remainder e.g. memory_block_size-s
-// if remainder is less than MIN_BLOCK_SIZE we just take whole block
-static inline memory_block* split_memory_block(memory_block* b, size_t s){
-    size_t remainder = b->size - s;
-    if(remainder >= MIN_BLOCK_SIZE){
-        memory_block* nb = shift_block_ptr(b,+s);
-        nb->size = remainder;
-        block_replace(b,nb);
-        b->size = s;
+// append block to freelist index
+// block that doesn't fit is left out of it, it can't be found by search but is still merged
+static inline void index_add(block_index* ix, memory_block* b){
+    if(!index_reserve(ix)){
+        b->slot = INDEX_NONE;
+        return;
+    }
+    ix->sizes[ix->count] = block_size(b);
+    ix->blocks[ix->count] = b;
+    b->slot = ix->count++;
+}
+
+// remove block from freelist index
+static inline void index_remove(block_index* ix, memory_block* b){
+    if(b->slot == INDEX_NONE)
+        return;
+    if(b->slot + 1 == ix->count){
+        // trailing holes are dropped right away
+        --ix->count;
+        while(ix->count > 0 && ix->sizes[ix->count-1] == 0){
+            --ix->count;
+            --ix->holes;
+        }
     }else{
-        block_unlink(b);
+        ix->sizes[b->slot] = 0;
+        ++ix->holes;
     }
-    return b;
 }
 
-static inline size_t find_optimal_memory_size(size_t s){
-    size_t suitable_size = MIN_BLOCK_SIZE;
+// put block nb in place of block b in freelist index
+static inline void index_replace(block_index* ix, memory_block* b, memory_block* nb){
+    nb->slot = b->slot;
+    if(nb->slot == INDEX_NONE)
+        return;
+    ix->sizes[nb->slot] = block_size(nb);
+    ix->blocks[nb->slot] = nb;
+}
 
-    while(suitable_size < s)
-        suitable_size = suitable_size << 1;
+// find last slot of block of at least size ns in sizes of n blocks
+static size_t index_scan_scalar(const size_t* sizes, size_t n, size_t ns){
+    while(n > 0){
+        --n;
+        if(sizes[n] >= ns)
+            return n;
+    }
+    return INDEX_NONE;
+}
 
-    return suitable_size;
+#if defined(__x86_64__)
+// block sizes are below 2^63 so signed compare works for them
+__attribute__((target("sse4.2")))
+static size_t index_scan_sse42(const size_t* sizes, size_t n, size_t ns){
+    __m128i v = _mm_set1_epi64x(ns - 1);
+    while(n >= 8){
+        n -= 8;
+        int m = (_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm_loadu_si128((const __m128i*)(sizes+n+6)),v))) << 6) |
+                (_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm_loadu_si128((const __m128i*)(sizes+n+4)),v))) << 4) |
+                (_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm_loadu_si128((const __m128i*)(sizes+n+2)),v))) << 2) |
+                _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm_loadu_si128((const __m128i*)(sizes+n)),v)));
+        if(m != 0)
+            return n + 31 - __builtin_clz(m);
+    }
+    return index_scan_scalar(sizes,n,ns);
 }
 
-// find suitable memory block for size s
-static inline memory_block* find_suitable_block(uint8_t fi, size_t ns){
+__attribute__((target("avx2")))
+static size_t index_scan_avx2(const size_t* sizes, size_t n, size_t ns){
+    __m256i v = _mm256_set1_epi64x(ns - 1);
+    while(n >= 16){
+        n -= 16;
+        int m = (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i*)(sizes+n+12)),v))) << 12) |
+                (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i*)(sizes+n+8)),v))) << 8) |
+                (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i*)(sizes+n+4)),v))) << 4) |
+                _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_loadu_si256((const __m256i*)(sizes+n)),v)));
+        if(m != 0)
+            return n + 31 - __builtin_clz(m);
+    }
+    return index_scan_sse42(sizes,n,ns);
+}
+#endif
 
-    memory_block* b = freelist_start(fi);
-    while(b != freelist_end(fi)){
-        if(b->size >= ns){
-            return split_memory_block(b,ns);                    
-        }
-        b = b->next;
+// search kernel is picked on first use from what cpu supports
+static size_t (*index_scan)(const size_t*, size_t, size_t) = null;
+
+// find slot of last added block of at least size ns in freelist index
+static inline size_t index_find(block_index* ix, size_t ns){
+    if(index_scan == null){
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+            index_scan = index_scan_avx2;
+        else if(__builtin_cpu_supports("sse4.2"))
+            index_scan = index_scan_sse42;
+        else
+#endif
+            index_scan = index_scan_scalar;
     }
+    return index_scan(ix->sizes,ix->count,ns);
+}
 
-    return null;
+// mark block as free in freelist fi and let right adjacent block know about it
+static inline void mark_block_free(uint8_t fi, memory_block* b){
+    block_update(b, BLOCK_FREE_MASK, freelist_tag(fi) << BLOCK_FREE_SHIFT);
+    block_footer(b) = block_size(b);
+    block_update(block_end(b), BLOCK_PREV_FREE_MASK, freelist_tag(fi) << BLOCK_PREV_FREE_SHIFT);
 }
 
-void* malloc(size_t s){
-    // check for 0 size
-    if(s == 0)
-        return null;
-    // add size of size_t as we need to save size of memory block
-    s += sizeof(size_t);
-    // find suitable memory size
-    size_t ns = find_optimal_memory_size(s);
+// mark block as used and let right adjacent block know about it
+static inline void mark_block_used(memory_block* b){
+    block_update(b, BLOCK_FREE_MASK, 0);
+    block_update(block_end(b), BLOCK_PREV_FREE_MASK, 0);
+}
+
+// coarse monotonic time in ns
+static inline uint64_t heap_clock(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+    return (uint64_t)ts.tv_sec*1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+// move start of top block to b that is owned by the caller
+// left adjacent block tag of b is kept as it might be free in some freelist
+static inline void heap_top_move(memory_block* b){
+    heap_top = b;
+    block_update(b, BLOCK_SIZE_MASK|BLOCK_FREE_MASK, heap_top_size | (BLOCK_TOP_TAG << BLOCK_FREE_SHIFT));
+}
 
-    // if size is greater than or equals MMAP_SIZE we are going to use mmap
-    if(ns >= MMAP_SIZE){
-        void* m = mmap(NULL,s,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+// reserve address space for chunks aligned to CHUNK_SIZE
+// if that much address space isn't available half as much is tried
+static inline bool heap_reserve(){
+    if(heap_reserve_start != null)
+        return heap_reserve_start != MAP_FAILED;
+    for(size_t s = HEAP_RESERVE_SIZE; s >= CHUNK_SIZE; s /= 2){
+        // one chunk more is reserved so that reservation can be aligned
+        uint8_t* m = mmap(null,s + CHUNK_SIZE,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
         if(m == MAP_FAILED)
-            return null;
-        memory_block* b = (memory_block*)m;
-        b->size = s;
-        global_lock();
-        mmap_size += s;
-        global_unlock();
-        return block_data(b);
+            continue;
+        uint8_t* c = byte_ptr(chunk_start(m + CHUNK_SIZE - 1));
+        if(c > m)
+            munmap(m,c - m);
+        munmap(c + s,m + CHUNK_SIZE - c);
+        heap_reserve_top = c;
+        heap_reserve_end = c + s;
+        // start is set last so that range check never sees partial reservation
+        __atomic_store_n(&heap_reserve_start,c,__ATOMIC_RELEASE);
+        return true;
     }
+    heap_reserve_start = heap_reserve_end = MAP_FAILED;
+    return false;
+}
 
-    memory_block* block;
-    uint8_t fj = FREELIST_SIZE*2;
-    uint8_t fi = fj;
-    while(fj > 0){
-        fi = freelist_lock(fi);
-        // find free memory block
-        block = find_suitable_block(fi,ns);
-        if(block != null){
-            unlock_freelist(fi);
-            // shift pointer into data block pointer
-            return block_data(block);
-        }
-        unlock_freelist(fi);
-        --fj;
+#ifdef BACKGROUND_THREAD
+// background thread
+// chunks and mmap blocks to be unmapped are pushed to a lock free list that background
+// thread takes as a whole, once per decay step it also does purging and merging that
+// freeing threads would do otherwise so that they don't make those syscalls, least of
+// all while holding locks. thread is started on first free as creating it allocates memory.
+// freeing thread unmaps by itself if thread isn't running or BACKGROUND_PENDING bytes are queued
+#define BG_NONE 0
+#define BG_STARTING 1
+#define BG_RUNNING 2
+#define BG_FAILED 3
+static uint32_t bg_state = BG_NONE;
+static memory_block* bg_queue = null; // blocks to unmap linked through next
+static size_t bg_pending = 0; // bytes in queue
+static uint32_t bg_signal = 0; // set when queue becomes non empty, background thread sleeps on it
+static uint64_t bg_step = 0; // decay step background thread last did its work at
+#define bg_active() (__atomic_load_n(&bg_state,__ATOMIC_ACQUIRE) == BG_RUNNING)
+
+// queue chunk or mmap block b of s bytes to be unmapped by background thread
+// false is returned if caller has to unmap it
+static inline bool bg_push(memory_block* b, size_t s){
+    if(!bg_active())
+        return false;
+    if(__atomic_add_fetch(&bg_pending,s,__ATOMIC_RELAXED) > BACKGROUND_PENDING){
+        __atomic_sub_fetch(&bg_pending,s,__ATOMIC_RELAXED);
+        return false;
     }
+    memory_block* h = __atomic_load_n(&bg_queue,__ATOMIC_RELAXED);
+    do{
+        b->next = h;
+    }while(!__atomic_compare_exchange_n(&bg_queue,&h,b,true,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+    if(h == null && __atomic_exchange_n(&bg_signal,1,__ATOMIC_RELEASE) == 0)
+        futex_wake(&bg_signal,1);
+    return true;
+}
+#else
+#define bg_active() false
+#define bg_push(b,s) false
+#endif
 
-    // no free memory blocks found
-    // we need to allocate new one that would be suitable for our needs using sbrk
-    size_t pages_size = ((ns/PAGE_SIZE)+1)*PAGE_SIZE;
-    if(pages_size < ALLOC_SIZE)
-        pages_size = ALLOC_SIZE;
-    // allocate memory with sbrk
-    global_lock();
-    void* p = sbrk(pages_size);
-    if(p == (void*)-1){
-        global_unlock();
+// commit new chunk from reservation
+// only the thread growing heap commits chunks while other threads might decommit them
+static inline memory_block* chunk_map(){
+    if(!heap_reserve())
+        return null;
+    uint8_t* c = null;
+    // decommitted chunk slots are reused first, only words of slots committed before are looked at
+    size_t n = ((heap_reserve_top - heap_reserve_start)/CHUNK_SIZE + 63)/64;
+    for(size_t i = 0; c == null && i < n; ++i){
+        uint64_t w = __atomic_load_n(&(heap_reserve_free[i]),__ATOMIC_ACQUIRE);
+        if(w != 0){
+            __atomic_fetch_and(&(heap_reserve_free[i]),~(w & -w),__ATOMIC_ACQ_REL);
+            c = heap_reserve_start + (i*64 + __builtin_ctzl(w))*CHUNK_SIZE;
+        }
+    }
+    if(c == null){
+        if(heap_reserve_top == heap_reserve_end)
+            return null;
+        c = heap_reserve_top;
+        heap_reserve_top += CHUNK_SIZE;
+    }
+    if(mprotect(c,CHUNK_SIZE,PROT_READ|PROT_WRITE) != 0){
+        size_t i = (c - heap_reserve_start)/CHUNK_SIZE;
+        __atomic_fetch_or(&(heap_reserve_free[i/64]),1UL << (i%64),__ATOMIC_RELEASE);
         return null;
     }
+#ifdef HEAP_HUGEPAGE
+    // decommitted slot lost its advice so it's given on every commit
+    madvise(c,CHUNK_SIZE,MADV_HUGEPAGE);
+#endif
+    chunk_fence(c)->size = 0;
+    return (memory_block*)c;
+}
 
-    block = (memory_block*)p;
-    heap_size += pages_size;
-    block->size = ns;
-    heap_end = shift_block_ptr(block,+pages_size);
-    heap_start = shift_block_ptr(heap_end,-heap_size);
-    global_unlock();
-    ns = pages_size - ns;
-    if(ns >= MIN_BLOCK_SIZE){
-        memory_block* b = shift_block_ptr(block,+block->size);
-        b->size = ns;
+// give chunk c back to the operating system keeping its slot reserved
+static inline void chunk_release(memory_block* c){
+    // mapping it again without access drops its pages and commit charge
+    mmap(c,CHUNK_SIZE,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED,-1,0);
+    size_t i = (byte_ptr(c) - heap_reserve_start)/CHUNK_SIZE;
+    __atomic_fetch_or(&(heap_reserve_free[i/64]),1UL << (i%64),__ATOMIC_RELEASE);
+}
 
-        fi = freelist_lock_any();
-        add_block(fi,b);
-        unlock_freelist(fi);
-    }else
-        block->size = pages_size;
+// give chunk c back to the operating system in background or right away
+static inline void chunk_unmap(memory_block* c){
+    if(!bg_push(c,CHUNK_SIZE))
+        chunk_release(c);
+}
 
-    return block_data(block);
+// take free block b out of freelist fj so that it can be merged into block of other freelist
+// its tags are cleared so that holder of fj doesn't merge with it once fj is unlocked
+// freelist fj lock must be held
+static inline void take_free_block(uint8_t fj, memory_block* b){
+    block_unlink(b);
+    index_remove(freelist_index(fj),b);
+    mark_block_used(b);
 }
 
-// merge with adjacent block so that overall new size would be s
-static inline memory_block* merge_with_adjacent_block(uint8_t fi, memory_block* block, size_t s){
+// purging
+// whole pages inside free blocks are given back to the operating system once they stayed
+// free long enough. pages freed k decay steps ago may stay resident as long as all resident
+// free bytes don't exceed bytes freed in last steps weighted by 1 - smoothstep(k/PURGE_STEPS)
+// so that memory freed in a burst is given back gradually, oldest first, and memory that is
+// reused soon isn't purged and faulted in again
+#define purge_step_of(t) ((t)/(purge_decay_time/PURGE_STEPS))
+#define PURGE_MIN_SIZE (2*PAGE_MAP_PAGE) // free blocks smaller than this might have no whole page
+#ifdef PURGE_LAZY
+#define PURGE_ADVICE MADV_FREE
+#else
+#define PURGE_ADVICE MADV_DONTNEED
+#endif
 
-    if(freelist_start(fi) == freelist_end(fi))
-        return null;
+// count s bytes freed to freelist fi at time t
+// freelist lock must be held
+static inline void purge_count(uint8_t fi, uint64_t t, size_t s){
+    freelist_state* st = &(freelist_states[fi/2]);
+    uint64_t n = purge_step_of(t);
+    if(n != st->freed_step){
+        // entries of steps that passed since are reused
+        for(uint64_t m = n; m > st->freed_step && m + PURGE_STEPS > n; --m)
+            st->purge_freed[m % PURGE_STEPS] = 0;
+        st->freed_step = n;
+    }
+    if(s >= PURGE_MIN_SIZE)
+        st->purge_freed[n % PURGE_STEPS] += s;
+}
 
-    memory_block* b = freelist_start(fi);
-    memory_block* be = block_end(block);
-    do {
-        // left adjacent
-        // code is slightly more complex as we need to copy data over
-        if(block_end(b) == block){
-            size_t bs =  b->size + block->size;
-            if(bs >= s){
-                size_t remainder = bs - s;
-                // we need to backup block pointers as they might be overwritten by memcpy
-                memory_block* temp_prev = b->prev;
-                memory_block* temp_next = b->next;
-                memcpy(block_data(b),block_data(block), block->size - sizeof(size_t));
-                if(remainder >= MIN_BLOCK_SIZE){
-                    b->size = s;
-                    memory_block* nb = shift_block_ptr(b,+s);
-                    nb->size = remainder;
-                    block_link(temp_prev,nb);
-                    block_link(nb,temp_next);
-                }else{
-                    b->size = bs;
-                    // unfortunetly here we can't use b->prev as
-                    // it might have been overwritten by memcpy
-                    // so we need to remove remaining block entirely using temporary pointers
-                    block_link(temp_prev,temp_next);
-                }
-                return b;
-            }
-        }
+// give whole pages between a and b back to the operating system
+static inline bool purge_range(uint8_t* a, uint8_t* b){
+    uintptr_t s = ((uintptr_t)a + PAGE_MAP_PAGE - 1) & ~(PAGE_MAP_PAGE - 1);
+    uintptr_t e = (uintptr_t)b & ~(PAGE_MAP_PAGE - 1);
+    if(e <= s)
+        return false;
+    madvise((void*)s,e - s,PURGE_ADVICE);
+    return true;
+}
 
-        // right adjacent
-        if(be == b){
-            size_t bs = block->size + b->size;
-            if(bs >= s){
-                size_t remainder = bs - s;
-                if(remainder >= MIN_BLOCK_SIZE){
-                    memory_block* nb = shift_block_ptr(block,+s);
-                    nb->size = remainder;
-                    block_replace(b,nb);
-                    block->size = s;
-                }else{
-                    block_unlink(b);
-                    block->size = bs;
-                }
-                return block;
+// give pages of free block b back to the operating system, its header and footer stay
+static inline bool purge_block(memory_block* b){
+    b->stamp = 0;
+    return purge_range(byte_ptr(b) + sizeof(memory_block),byte_ptr(block_end(b)) - sizeof(size_t));
+}
+
+// add block to free list
+// adjacent blocks that are free in the same freelist are found using boundary tags and merged with it
+// adjacent blocks free in other freelists are merged too if their freelist isn't busy as
+// we can't wait for it while holding fi, otherwise block is counted as left unmerged
+// block adjacent to top block is merged into top block instead
+// null is returned if block's chunk was unmapped
+static inline memory_block* add_block(uint8_t fi, memory_block* block){
+    // merge left adjacent block
+    size_t tag = block_prev_free_tag(block);
+    if(tag == freelist_tag(fi)){
+        memory_block* lb = block_left(block);
+        block_unlink(lb);
+        index_remove(freelist_index(fi),lb);
+        block_update(lb, BLOCK_SIZE_MASK, block_size(lb) + block_size(block));
+        block = lb;
+    }else if(tag != 0 && tag <= freelist_count){
+        uint8_t fj = tag_freelist(tag);
+        if(trylock_freelist(fj)){
+            // left adjacent block might have been taken before we locked its freelist
+            if(block_prev_free_tag(block) == tag){
+                memory_block* lb = block_left(block);
+                take_free_block(fj,lb);
+                block_update(lb, BLOCK_SIZE_MASK, block_size(lb) + block_size(block));
+                block = lb;
             }
-            break;
+            unlock_freelist(fj);
+        }else
+            ++freelist_states[fi/2].unmerged;
+    }
+    // merge right adjacent block
+    memory_block* rb = block_end(block);
+    if(block_free_tag(rb) == BLOCK_TOP_TAG){
+        global_lock();
+        // top block might have been cut before we locked it
+        if(rb == heap_top){
+            // block becomes start of top block
+            heap_top_stamp = heap_clock();
+#ifdef HEAP_PREDICT
+            heap_cut = heap_cut > block_size(block) ? heap_cut - block_size(block) : 0;
+#endif
+            heap_top_move(block);
+            global_unlock();
+            return block;
         }
+        global_unlock();
+    }
+    tag = block_free_tag(rb);
+    if(tag == freelist_tag(fi)){
+        block_unlink(rb);
+        index_remove(freelist_index(fi),rb);
+        block_update(block, BLOCK_SIZE_MASK, block_size(block) + block_size(rb));
+    }else if(tag != 0 && tag <= freelist_count){
+        uint8_t fj = tag_freelist(tag);
+        if(trylock_freelist(fj)){
+            if(block_free_tag(rb) == tag){
+                take_free_block(fj,rb);
+                block_update(block, BLOCK_SIZE_MASK, block_size(block) + block_size(rb));
+            }
+            unlock_freelist(fj);
+        }else
+            ++freelist_states[fi/2].unmerged;
+    }
+    // chunk that became a single free block is given back to the operating system
+    if(chunk_free(block)){
+        global_lock();
+        heap_size -= CHUNK_SIZE;
+        global_unlock();
+        chunk_unmap(block);
+        return null;
+    }
+    mark_block_free(fi,block);
+    block->stamp = heap_clock();
+    purge_count(fi,block->stamp,block_size(block));
+
+    // insert block at the start of free list
+    memory_block* b = freelist_begin(fi);
+    block_link_right(b, block);
+    index_add(freelist_index(fi),block);
+    return block;
+}
 
-        b = b->next;
-    } while(b != freelist_end(fi) && b >= be);
+// split memory block into 2 pieces one of size s and the other is remainder e.g. memory_block_size-s
+// if remainder is less than MIN_BLOCK_SIZE we just take whole block
+static inline memory_block* split_memory_block(uint8_t fi, memory_block* b, size_t s){
+    size_t remainder = block_size(b) - s;
+    if(remainder >= min_block_size){
+        memory_block* nb = shift_block_ptr(b,+s);
+        memory_block* temp_prev = b->prev;
+        memory_block* temp_next = b->next;
+        nb->size = remainder | (freelist_tag(fi) << BLOCK_FREE_SHIFT);
+        nb->stamp = b->stamp;
+        block_footer(nb) = remainder;
+        block_link(temp_prev,nb);
+        block_link(nb,temp_next);
+        index_replace(freelist_index(fi),b,nb);
+        block_update(b, BLOCK_SIZE_MASK|BLOCK_FREE_MASK, s);
+    }else{
+        block_unlink(b);
+        index_remove(freelist_index(fi),b);
+        mark_block_used(b);
+    }
+    return b;
+}
 
-    return null;
+// split used memory block so that its size is s and add remainder to freelist fi
+static inline void split_used_block(uint8_t fi, memory_block* b, size_t s){
+    size_t remainder = block_size(b) - s;
+    if(remainder >= min_block_size){
+        memory_block* nb = shift_block_ptr(b,+s);
+        block_update(b, BLOCK_SIZE_MASK, s);
+        nb->size = remainder;
+        add_block(fi,nb);
+    }
 }
 
-void* realloc(void* p, size_t s){
-    if(p == null){
-        return malloc(s);
-    }else if(s == 0){
-        free(p);
+// size classes
+// 8 classes of 16 bytes up to 128 bytes and 4 classes for every power of 2 after that
+#define SIZE_CLASS_COUNT 80
+static const size_t size_classes[SIZE_CLASS_COUNT] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+    5120, 6144, 7168, 8192,
+    10240, 12288, 14336, 16384,
+    20480, 24576, 28672, 32768,
+    40960, 49152, 57344, 65536,
+    81920, 98304, 114688, 131072,
+    163840, 196608, 229376, 262144,
+    327680, 393216, 458752, 524288,
+    655360, 786432, 917504, 1048576,
+    1310720, 1572864, 1835008, 2097152,
+    2621440, 3145728, 3670016, 4194304,
+    5242880, 6291456, 7340032, 8388608,
+    10485760, 12582912, 14680064, 16777216,
+    20971520, 25165824, 29360128, 33554432,
+};
+
+// find size class for size s
+// sizes up to 128 are treated as if they were in 64..128 power of 2 range
+// so both ranges are computed with the same shift
+static inline unsigned int size_class(size_t s){
+    size_t m = (s - 1) | 64;
+    unsigned int k = 63 - __builtin_clzl(m);
+    return ((k - 6) << 2) + ((s - 1) >> (k - 2));
+}
+
+// find optimal memory block size for size s
+static inline size_t find_optimal_memory_size(size_t s){
+    if(s < min_block_size)
+        s = min_block_size;
+    unsigned int c = size_class(s);
+    // sizes beyond last size class are only allocated with mmap
+    if(c >= SIZE_CLASS_COUNT)
+        return s;
+    return size_classes[c];
+}
+
+// find suitable memory block for size s
+// first fit is searched in freelist index instead of walking freelist
+static inline memory_block* find_suitable_block(uint8_t fi, size_t ns){
+    size_t i = index_find(freelist_index(fi),ns);
+    if(i == INDEX_NONE)
         return null;
-    }
-    
-    // shift pointer back into memory block pointer
-    memory_block* b = data_block(p);
+    return split_memory_block(fi,freelist_index(fi)->blocks[i],ns);
+}
 
-    // find out which new optimal size we need
-    size_t ss = s+sizeof(size_t);
-    size_t ns = find_optimal_memory_size(ss);
+// find quick list for block of size s
+// block must be at least as big as its size class
+static inline unsigned int quick_class(size_t s){
+    unsigned int c = size_class(s);
+    if(size_classes[c] > s)
+        --c;
+    return c;
+}
 
-    // if memory is mmap we need to use mremap
-    global_lock();
-    if(is_mmap_block(b)){
-        mmap_size = (mmap_size - b->size) + ss;
-        global_unlock();
-        void* p = mremap(b,b->size,ss,MREMAP_MAYMOVE);
-        if(p == MAP_FAILED)
-            return null;
-        b = (memory_block*)p;
-        b->size = ss;
-        return block_data(b);
+// push freed block to its quick list of freelist fi
+static inline void quick_push(uint8_t fi, memory_block* b){
+    unsigned int c = quick_class(block_size(b));
+    b->next = freelist_states[fi/2].quick_lists[c];
+    freelist_states[fi/2].quick_lists[c] = b;
+    freelist_states[fi/2].quick_size += block_size(b);
+}
+
+// pop block of size class of ns from its quick list of freelist fi
+static inline memory_block* quick_pop(uint8_t fi, size_t ns){
+    unsigned int c = size_class(ns);
+    memory_block* b = freelist_states[fi/2].quick_lists[c];
+    if(b != null){
+        freelist_states[fi/2].quick_lists[c] = b->next;
+        freelist_states[fi/2].quick_size -= block_size(b);
     }
-    global_unlock();
+    return b;
+}
 
-    if(ns < MMAP_SIZE){
-        // check if size is already sufficient
-        if(b->size >= ns){
-            return p;
+// merge all blocks from quick lists of freelist fi into it
+static inline void quick_consolidate(uint8_t fi){
+    for(unsigned int c = 0; c < QUICK_CLASS_COUNT; ++c){
+        memory_block* b = freelist_states[fi/2].quick_lists[c];
+        freelist_states[fi/2].quick_lists[c] = null;
+        while(b != null){
+            memory_block* nb = b->next;
+            add_block(fi,b);
+            b = nb;
         }
+    }
+    freelist_states[fi/2].quick_size = 0;
+}
 
-#ifdef MERGE_ADJ_ON_REALLOC
-        // try merging with adjacent blocks
-        uint8_t fi = freelist_lock_any();
-        memory_block* nb = merge_with_adjacent_block(fi,b,ns);
-        if(nb != null){
-            unlock_freelist(fi);
-            // shift pointer into data block pointer
-            return block_data(nb);
+// merge blocks of freelist fi with adjacent blocks free in other freelists
+// only fi is locked while it's walked so other freelists are used meanwhile.
+// adjacent blocks are never free in the same freelist so re added blocks don't merge
+// with the rest of fi and walking it can continue from the next block
+// freelist lock must be held
+static inline void freelist_merge(uint8_t fi){
+    freelist_states[fi/2].unmerged = 0;
+    memory_block* b = freelist_start(fi);
+    while(b != freelist_end(fi)){
+        memory_block* nb = b->next;
+        size_t lt = block_prev_free_tag(b);
+        size_t rt = block_free_tag(block_end(b));
+        bool lo = lt != 0 && lt <= freelist_count && lt != freelist_tag(fi);
+        bool ro = rt != 0 && rt <= freelist_count && rt != freelist_tag(fi);
+        if(lo || ro){
+            take_free_block(fi,b);
+            add_block(fi,b);
         }
-        unlock_freelist(fi);
-#endif
+        b = nb;
     }
+}
 
-    void* np = malloc(s);
-    if(np != null){
-        // copy old data block into new one
-        memcpy(np,p,s > b->size ? b->size : s);
+#ifdef HEAP_HUGEPAGE
+// map s bytes aligned to HUGE_PAGE_SIZE and ask for them to be backed by huge pages
+static void* huge_map(size_t s){
+    uint8_t* m = mmap(null,s + HUGE_PAGE_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if(m == MAP_FAILED)
+        return MAP_FAILED;
+    uint8_t* a = (uint8_t*)(((uintptr_t)m + HUGE_PAGE_SIZE - 1) & ~((uintptr_t)HUGE_PAGE_SIZE - 1));
+    if(a > m)
+        munmap(m,a - m);
+    munmap(a + s,m + HUGE_PAGE_SIZE - a);
+    madvise(a,s,MADV_HUGEPAGE);
+    return a;
+}
+#endif
 
-        // free old data block
-        free(p);
+// reserve address space for slabs
+static inline bool slab_init(){
+    if(slab_region_start != null)
+        return slab_region_start != MAP_FAILED;
+#ifdef HEAP_HUGEPAGE
+    // slabs of all size classes are packed together in huge pages
+    void* m = huge_map(SLAB_REGION_SIZE);
+    void* d = huge_map((SLAB_REGION_SIZE/SLAB_SIZE)*sizeof(slab));
+#else
+    void* m = mmap(NULL,SLAB_REGION_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    void* d = mmap(NULL,(SLAB_REGION_SIZE/SLAB_SIZE)*sizeof(slab),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+#endif
+    if(m == MAP_FAILED || d == MAP_FAILED){
+        if(m != MAP_FAILED)
+            munmap(m,SLAB_REGION_SIZE);
+        if(d != MAP_FAILED)
+            munmap(d,(SLAB_REGION_SIZE/SLAB_SIZE)*sizeof(slab));
+        // slabs are disabled and small objects are allocated from heap
+        slab_region_start = slab_region_end = MAP_FAILED;
+        return false;
+    }
+    slabs = (slab*)d;
+    slab_region_start = slab_region_top = (uint8_t*)m;
+    slab_region_end = slab_region_start + SLAB_REGION_SIZE;
+    return true;
+}
 
-        // return newly allocated block
-        return np;
+// link slab at the start of slab list l
+#define slab_link(l,sl) \
+    sl->prev = null; \
+    sl->next = l; \
+    if(l != null) \
+        l->prev = sl; \
+    l = sl;
+
+// unlink slab from slab list l
+#define slab_unlink(l,sl) \
+    if(sl->prev != null) \
+        sl->prev->next = sl->next; \
+    else \
+        l = sl->next; \
+    if(sl->next != null) \
+        sl->next->prev = sl->prev;
+
+// push object to free stack of size class c unless it's full
+FREE_STACK_CAS static bool free_stack_push(uint8_t c, void* p){
+    free_stack* st = &(free_stacks[c]);
+    free_stack_head o, n;
+    o.word = st->head.word;
+    while(1){
+        if(o.count >= FREE_STACK_DEPTH)
+            return false;
+        *((void**)p) = o.top;
+        n.top = p;
+        n.tag = o.tag + 1;
+        n.count = o.count + 1;
+        unsigned __int128 r = __sync_val_compare_and_swap(&(st->head.word), o.word, n.word);
+        if(r == o.word)
+            return true;
+        o.word = r;
     }
-    
-    return null;
 }
 
-void free(void* p){
-    // check for null pointer
-    if(p == null)
-        return;
+// pop object from free stack of size class c
+FREE_STACK_CAS static void* free_stack_pop(uint8_t c){
+    free_stack* st = &(free_stacks[c]);
+    free_stack_head o, n;
+    o.word = st->head.word;
+    while(1){
+        if(o.top == null)
+            return null;
+        n.top = *((void**)o.top);
+        n.tag = o.tag + 1;
+        n.count = o.count - 1;
+        unsigned __int128 r = __sync_val_compare_and_swap(&(st->head.word), o.word, n.word);
+        if(r == o.word)
+            return o.top;
+        o.word = r;
+    }
+}
 
-    // shift pointer back into memory block pointer
-    memory_block* b = data_block(p);
+// get empty slab for size class c
+static inline slab* slab_new(uint8_t c){
+    lock_slab_pool();
+    slab* sl = slab_empty;
+    if(sl != null){
+        slab_empty = sl->next;
+    }else{
+        if(!slab_init() || slab_region_top == slab_region_end){
+            unlock_slab_pool();
+            return null;
+        }
+        sl = ptr_slab(slab_region_top);
+        slab_region_top += SLAB_SIZE;
+    }
+    unlock_slab_pool();
+    // free finds out size class of the object from page map
+    if(!page_map_set(slab_start(sl),SLAB_SIZE,PAGE_SLAB+c)){
+        lock_slab_pool();
+        sl->next = slab_empty;
+        slab_empty = sl;
+        unlock_slab_pool();
+        return null;
+    }
+    sl->free = null;
+    sl->top = 0;
+    sl->used = 0;
+    sl->size = size_classes[c];
+    sl->owner = null;
+    slab_link(slab_classes[c].partial,sl);
+    __atomic_add_fetch(&(slab_classes[c].count),1,__ATOMIC_RELAXED);
+    return sl;
+}
+
+// carve object from slab sl that isn't full
+// size class lock or ownership of the slab is needed
+static inline void* slab_carve(slab* sl){
+    void* o = sl->free;
+    if(o != null){
+        sl->free = *((void**)o);
+    }else{
+        o = slab_start(sl) + sl->top;
+        sl->top += sl->size;
+    }
+    ++sl->used;
+    return o;
+}
+
+// allocate object of size class c from slab
+// size class lock must be held
+static inline void* slab_alloc_object(uint8_t c){
+    slab* sl = slab_classes[c].partial;
+    if(sl == null){
+        sl = slab_new(c);
+        if(sl == null)
+            return null;
+    }
+
+    void* o = slab_carve(sl);
+    __atomic_add_fetch(&(slab_classes[c].used),1,__ATOMIC_RELAXED);
+    if(slab_full(sl)){
+        slab_unlink(slab_classes[c].partial,sl);
+    }
+    return o;
+}
+
+// move slab of size class c from shared partial list to slab lists of owner so
+// size class lock must be held
+static inline slab* slab_take(uint8_t c, slab_owner* so){
+    slab* sl = slab_classes[c].partial;
+    if(sl == null){
+        sl = slab_new(c);
+        if(sl == null)
+            return null;
+    }
+    slab_unlink(slab_classes[c].partial,sl);
+    slab_link(so->partial[c],sl);
+    __atomic_store_n(&(sl->owner),so,__ATOMIC_RELEASE);
+    return sl;
+}
+
+// carve object of size class c from slabs of owner so, shared slab is taken once they are full
+// only owner calls it and stats are updated by the caller
+static inline void* owner_alloc(uint8_t c, slab_owner* so){
+    slab* sl = so->partial[c];
+    if(sl == null){
+        lock_slab_class(c);
+        sl = slab_take(c,so);
+        unlock_slab_class(c);
+        if(sl == null)
+            return null;
+    }
+    void* o = slab_carve(sl);
+    if(slab_full(sl)){
+        slab_unlink(so->partial[c],sl);
+        slab_link(so->full[c],sl);
+    }
+    return o;
+}
+
+// return object p of size class c to its slab owned by so
+// only owner calls it and stats are updated by the caller
+static inline void owner_free(uint8_t c, slab_owner* so, void* p){
+    slab* sl = ptr_slab(p);
+    bool full = slab_full(sl);
+    *((void**)p) = sl->free;
+    sl->free = p;
+    --sl->used;
+    if(sl->used == 0){
+        // give slab to any size class that needs it
+        if(full){
+            slab_unlink(so->full[c],sl);
+        }else{
+            slab_unlink(so->partial[c],sl);
+        }
+        __atomic_store_n(&(sl->owner),null,__ATOMIC_RELAXED);
+        __atomic_sub_fetch(&(slab_classes[c].count),1,__ATOMIC_RELAXED);
+        lock_slab_pool();
+        sl->next = slab_empty;
+        slab_empty = sl;
+        unlock_slab_pool();
+    }else if(full){
+        slab_unlink(so->full[c],sl);
+        slab_link(so->partial[c],sl);
+    }
+}
+
+// push object p of size class c freed by another thread to remote list of owner so
+static inline void owner_remote_push(slab_owner* so, uint8_t c, void* p){
+    void* h = __atomic_load_n(&(so->remote[c]),__ATOMIC_RELAXED);
+    do{
+        *((void**)p) = h;
+    }while(!__atomic_compare_exchange_n(&(so->remote[c]),&h,p,true,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+}
+
+// take whole remote list of size class c of owner so
+static inline void* owner_remote_take(slab_owner* so, uint8_t c){
+    if(__atomic_load_n(&(so->remote[c]),__ATOMIC_RELAXED) == null)
+        return null;
+    return __atomic_exchange_n(&(so->remote[c]),null,__ATOMIC_ACQUIRE);
+}
+
+// allocate object of size s from free stack or slab
+static inline void* slab_alloc(size_t s){
+    uint8_t c = size_class(s);
+    void* o = free_stack_pop(c);
+    if(o != null)
+        return o;
+    lock_slab_class(c);
+    o = slab_alloc_object(c);
+    unlock_slab_class(c);
+    return o;
+}
+
+// return object of size class c back to its shared slab
+// size class lock must be held
+static inline void slab_free_object(uint8_t c, void* p){
+    slab* sl = ptr_slab(p);
+    bool full = slab_full(sl);
+    *((void**)p) = sl->free;
+    sl->free = p;
+    --sl->used;
+    __atomic_sub_fetch(&(slab_classes[c].used),1,__ATOMIC_RELAXED);
+    if(sl->used == 0){
+        // give slab to any size class that needs it
+        if(!full){
+            slab_unlink(slab_classes[c].partial,sl);
+        }
+        __atomic_sub_fetch(&(slab_classes[c].count),1,__ATOMIC_RELAXED);
+        lock_slab_pool();
+        sl->next = slab_empty;
+        slab_empty = sl;
+        unlock_slab_pool();
+    }else if(full){
+        slab_link(slab_classes[c].partial,sl);
+    }
+}
+
+// return object of size class c to its slab or to remote list of the slab owner
+// size class lock must be held so that no cache takes the slab meanwhile
+static inline void slab_free_locked(uint8_t c, void* p){
+    slab_owner* so = ptr_slab(p)->owner;
+    if(so != null)
+        owner_remote_push(so,c,p);
+    else
+        slab_free_object(c,p);
+}
+
+// return object of size class c freed by a thread that doesn't own its slab
+// owned slab gets it through remote list and shared slab through free stack
+static inline void slab_free(uint8_t c, void* p){
+    slab_owner* so = __atomic_load_n(&(ptr_slab(p)->owner),__ATOMIC_ACQUIRE);
+    if(so != null){
+        owner_remote_push(so,c,p);
+        return;
+    }
+    if(free_stack_push(c,p))
+        return;
+    lock_slab_class(c);
+    slab_free_locked(c,p);
+    unlock_slab_class(c);
+}
+
+// make owner so the owner of shared slab sl of size class c
+// false if another cache took the slab meanwhile
+static inline bool slab_adopt(uint8_t c, slab_owner* so, slab* sl){
+    lock_slab_class(c);
+    bool shared = sl->owner == null;
+    if(shared){
+        if(slab_full(sl)){
+            slab_link(so->full[c],sl);
+        }else{
+            slab_unlink(slab_classes[c].partial,sl);
+            slab_link(so->partial[c],sl);
+        }
+        __atomic_store_n(&(sl->owner),so,__ATOMIC_RELEASE);
+    }
+    unlock_slab_class(c);
+    return shared;
+}
+
+// pop object of size class c from free stack for owner so
+// owner takes over shared slab of the object so that its neighbours aren't handed to other
+// caches later, object of a slab owned by another cache is pushed to that cache instead
+static inline void* owner_free_stack_pop(uint8_t c, slab_owner* so){
+    for(uint32_t i = 0; i < CACHE_BATCH; ++i){
+        void* p = free_stack_pop(c);
+        if(p == null)
+            return null;
+        slab* sl = ptr_slab(p);
+        slab_owner* po = __atomic_load_n(&(sl->owner),__ATOMIC_ACQUIRE);
+        if(po == so || (po == null && slab_adopt(c,so,sl)))
+            return p;
+        slab_free(c,p);
+    }
+    return null;
+}
+
+#ifdef CPU_CACHE
+// find rseq area of current thread, null if rseq isn't used
+static inline rseq_area* rseq_current(){
+#if defined(__x86_64__)
+    if(&__rseq_size == null || __rseq_size == 0)
+        return null;
+    uint8_t* tp;
+    __asm__ ("mov %%fs:0, %0" : "=r"(tp));
+    rseq_area* rs = (rseq_area*)(tp + __rseq_offset);
+    // registration might have failed for this thread
+    if((int32_t)rs->cpu_id < 0)
+        return null;
+    return rs;
+#else
+    return null;
+#endif
+}
+
+#if defined(__x86_64__)
+// restartable sequence descriptor and abort handler
+// abort handler is preceded by signature and jumps to label 5
+#define RSEQ_CS_DEFINE \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    "3:\n\t" \
+    ".long 0x0, 0x0\n\t" \
+    ".quad 1f, (2f - 1f), 4f\n\t" \
+    ".popsection\n\t" \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".byte 0x0f, 0xb9, 0x3d\n\t" \
+    ".long " RSEQ_SIG "\n\t" \
+    "4:\n\t" \
+    "jmp 5f\n\t" \
+    ".popsection\n\t" \
+    "leaq 3b(%%rip), %%rax\n\t" \
+    "movq %%rax, %[rseq_cs]\n\t"
+
+// pop object from cache of size class c of cpu in restartable sequence
+// returns 0 on success, 1 if sequence was aborted and 2 if cache is empty
+static inline int rseq_pop(rseq_area* rs, uint32_t cpu, uint8_t c, void** p){
+    cpu_cache* cc = &(cpu_caches[cpu]);
+    int r;
+    __asm__ __volatile__ (
+        RSEQ_CS_DEFINE
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 5f\n\t"
+        "movl %[count], %%eax\n\t"
+        "testl %%eax, %%eax\n\t"
+        "jz 6f\n\t"
+        "movq -8(%[slots],%%rax,8), %[p]\n\t"
+        "decl %%eax\n\t"
+        // commit
+        "movl %%eax, %[count]\n\t"
+        "2:\n\t"
+        "movl $0, %[r]\n\t"
+        "jmp 7f\n\t"
+        "5:\n\t"
+        "movl $1, %[r]\n\t"
+        "jmp 7f\n\t"
+        "6:\n\t"
+        "movl $2, %[r]\n\t"
+        "7:\n\t"
+        : [r]"=&r"(r), [p]"=&r"(*p), [count]"+m"(cc->count[c]), [rseq_cs]"=m"(rs->rseq_cs)
+        : [cpu]"r"(cpu), [cpu_id]"m"(rs->cpu_id), [slots]"r"(cc->slots[c])
+        : "rax", "memory", "cc");
+    return r;
+}
+
+// push object to cache of size class c of cpu in restartable sequence
+// returns 0 on success, 1 if sequence was aborted and 2 if cache is full
+static inline int rseq_push(rseq_area* rs, uint32_t cpu, uint8_t c, void* p){
+    cpu_cache* cc = &(cpu_caches[cpu]);
+    int r;
+    __asm__ __volatile__ (
+        RSEQ_CS_DEFINE
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 5f\n\t"
+        "movl %[count], %%eax\n\t"
+        "cmpl %[depth], %%eax\n\t"
+        "jae 6f\n\t"
+        "movq %[p], (%[slots],%%rax,8)\n\t"
+        "incl %%eax\n\t"
+        // commit
+        "movl %%eax, %[count]\n\t"
+        "2:\n\t"
+        "movl $0, %[r]\n\t"
+        "jmp 7f\n\t"
+        "5:\n\t"
+        "movl $1, %[r]\n\t"
+        "jmp 7f\n\t"
+        "6:\n\t"
+        "movl $2, %[r]\n\t"
+        "7:\n\t"
+        : [r]"=&r"(r), [count]"+m"(cc->count[c]), [rseq_cs]"=m"(rs->rseq_cs)
+        : [cpu]"r"(cpu), [cpu_id]"m"(rs->cpu_id), [slots]"r"(cc->slots[c]), [p]"r"(p), [depth]"i"(CPU_CACHE_DEPTH)
+        : "rax", "memory", "cc");
+    return r;
+}
+#endif
+
+// cpu the thread runs on when rseq isn't used
+// sched_getcpu fails under some seccomp filters and old kernels so cache of cpu 0 is used then
+static inline uint32_t cpu_current(){
+    int cpu = sched_getcpu();
+    return cpu >= 0 && (uint32_t)cpu < cpu_count ? (uint32_t)cpu : 0;
+}
+
+// pop object from cache of size class c of current cpu
+static inline void* cpu_cache_pop(uint8_t c){
+    rseq_area* rs = rseq_current();
+#if defined(__x86_64__)
+    if(rs != null){
+        while(1){
+            void* p;
+            int r = rseq_pop(rs,rs->cpu_id,c,&p);
+            if(r == 0)
+                return p;
+            if(r == 2)
+                return null;
+        }
+    }
+#endif
+    cpu_cache* cc = &(cpu_caches[cpu_current()]);
+    void* p = null;
+    lock(&(cc->lock));
+    if(cc->count[c] > 0)
+        p = cc->slots[c][--cc->count[c]];
+    unlock(&(cc->lock));
+    return p;
+}
+
+// push object to cache of size class c of current cpu
+static inline bool cpu_cache_push(uint8_t c, void* p){
+    rseq_area* rs = rseq_current();
+#if defined(__x86_64__)
+    if(rs != null){
+        while(1){
+            int r = rseq_push(rs,rs->cpu_id,c,p);
+            if(r == 0)
+                return true;
+            if(r == 2)
+                return false;
+        }
+    }
+#endif
+    cpu_cache* cc = &(cpu_caches[cpu_current()]);
+    bool pushed = false;
+    lock(&(cc->lock));
+    if(cc->count[c] < CPU_CACHE_DEPTH){
+        cc->slots[c][cc->count[c]++] = p;
+        pushed = true;
+    }
+    unlock(&(cc->lock));
+    return pushed;
+}
 
+// check if cpu caches can be used allocating them on first use
+static inline bool cache_active(){
+    if(cpu_caches != null)
+        return true;
+    uint32_t n = sysconf(_SC_NPROCESSORS_CONF);
+    void* m = mmap(NULL,n*sizeof(cpu_cache),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if(m == MAP_FAILED)
+        return false;
     global_lock();
-    if(is_mmap_block(b)){
-        mmap_size -= b->size;
-        global_unlock();
-        munmap(b,b->size);        
-        return;    
+    if(cpu_caches == null){
+        cpu_count = n;
+        __sync_synchronize();
+        cpu_caches = (cpu_cache*)m;
+        m = null;
     }
     global_unlock();
+    // other thread allocated them meanwhile
+    if(m != null)
+        munmap(m,n*sizeof(cpu_cache));
+    return true;
+}
+
+// slab owner of current cpu
+static inline slab_owner* cache_owner(){
+    rseq_area* rs = rseq_current();
+    return &(cpu_caches[rs != null ? rs->cpu_id : cpu_current()].owner);
+}
+
+// move up to n objects of size class c from current cpu cache back to slabs or quick lists
+static inline void cache_flush(uint8_t c, uint32_t n){
+    void* objects[CACHE_BATCH];
+    uint32_t k = 0;
+    while(k < n && (objects[k] = cpu_cache_pop(c)) != null)
+        ++k;
+    if(k == 0)
+        return;
+    if(c < SLAB_CLASS_COUNT){
+        // objects go back to slabs of this cpu, those pushed by a thread that migrated
+        // meanwhile go to their owner
+        slab_owner* so = cache_owner();
+        uint32_t n = 0;
+        lock(&(so->lock));
+        for(uint32_t i = 0; i < k; ++i){
+            if(ptr_slab(objects[i])->owner == so){
+                owner_free(c,so,objects[i]);
+                ++n;
+            }else
+                slab_free(c,objects[i]);
+        }
+        unlock(&(so->lock));
+        __atomic_sub_fetch(&(slab_classes[c].used),n,__ATOMIC_RELAXED);
+    }else{
+        uint8_t fi = home_freelist();
+        lock_freelist(fi);
+        for(uint32_t i = 0; i < k; ++i)
+            quick_push(fi,data_block(objects[i]));
+        unlock_freelist(fi);
+    }
+}
+
+// push object to cache of size class c
+// a batch of objects is flushed if it's full
+static inline bool cache_push(uint8_t c, void* p){
+    if(!cache_active())
+        return false;
+    if(cpu_cache_push(c,p))
+        return true;
+    cache_flush(c,CACHE_BATCH);
+    return cpu_cache_push(c,p);
+}
+
+// pop object from cache of size class c
+#define cache_pop(c) cpu_cache_pop(c)
+
+// allocate object of size class c from slabs of current cpu and fill its cache with a batch of them
+// objects freed by other cpus come first and objects pushed after thread migrated go to
+// cache of the other cpu
+static inline void* cache_fill_slab(uint8_t c){
+    slab_owner* so = cache_owner();
+    uint32_t carved = 0, freed = 0;
+    lock(&(so->lock));
+    void* o = null;
+    void* r = owner_remote_take(so,c);
+    while(r != null){
+        void* nr = *((void**)r);
+        if(o == null)
+            o = r;
+        else if(!cpu_cache_push(c,r)){
+            owner_free(c,so,r);
+            ++freed;
+        }
+        r = nr;
+    }
+    if(o == null)
+        o = owner_free_stack_pop(c,so);
+    if(o == null){
+        o = owner_alloc(c,so);
+        for(uint32_t i = 1; o != null && i < CACHE_BATCH; ++i){
+            void* no = owner_alloc(c,so);
+            if(no == null)
+                break;
+            if(!cpu_cache_push(c,no)){
+                owner_free(c,so,no);
+                break;
+            }
+            ++carved;
+        }
+        if(o != null)
+            ++carved;
+    }
+    unlock(&(so->lock));
+    if(carved > 0)
+        __atomic_add_fetch(&(slab_classes[c].used),carved,__ATOMIC_RELAXED);
+    if(freed > 0)
+        __atomic_sub_fetch(&(slab_classes[c].used),freed,__ATOMIC_RELAXED);
+    return o;
+}
+
+// fill cache with a batch of blocks of size class c from quick list of freelist fi
+// freelist lock must be held
+static inline void cache_fill_quick(uint8_t fi, uint8_t c){
+    for(uint32_t i = 1; i < CACHE_BATCH; ++i){
+        memory_block* b = quick_pop(fi,size_classes[c]);
+        if(b == null)
+            break;
+        if(!cpu_cache_push(c,block_data(b))){
+            quick_push(fi,b);
+            break;
+        }
+    }
+}
+#else
+// move n objects from the start of thread cache list of size class c back to slabs or quick lists
+static inline void tcache_flush(uint8_t c, uint32_t n){
+    void* o = tcache.head[c];
+    tcache.count[c] -= n;
+    if(c < SLAB_CLASS_COUNT){
+        // only objects of owned slabs are kept so they go back without locking
+        __atomic_sub_fetch(&(slab_classes[c].used),n,__ATOMIC_RELAXED);
+        while(n-- > 0){
+            void* no = *((void**)o);
+            owner_free(c,tcache.owner,o);
+            o = no;
+        }
+    }else{
+        uint8_t fi = home_freelist();
+        lock_freelist(fi);
+        while(n-- > 0){
+            void* no = *((void**)o);
+            quick_push(fi,data_block(o));
+            o = no;
+        }
+        unlock_freelist(fi);
+    }
+    tcache.head[c] = o;
+}
+
+// get slab owner record for new thread cache, records of exited threads are reused first
+static slab_owner* slab_owner_new(){
+    global_lock();
+    slab_owner* so = slab_owners_unused;
+    if(so != null)
+        slab_owners_unused = so->next;
+    global_unlock();
+    if(so != null)
+        return so;
+    slab_owner* m = mmap(null,SLAB_OWNER_BATCH*sizeof(slab_owner),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if(m == MAP_FAILED)
+        return null;
+    global_lock();
+    for(uint32_t i = 1; i < SLAB_OWNER_BATCH; ++i){
+        m[i].next = slab_owners_unused;
+        slab_owners_unused = &(m[i]);
+    }
+    global_unlock();
+    return m;
+}
+
+// give slabs of exited thread back to shared partial lists and its record to next new thread
+// objects pushed to it after that are drained by the next owner of the record
+static void slab_owner_release(slab_owner* so){
+    for(uint8_t c = 0; c < SLAB_CLASS_COUNT; ++c){
+        lock_slab_class(c);
+        while(so->partial[c] != null){
+            slab* sl = so->partial[c];
+            slab_unlink(so->partial[c],sl);
+            sl->owner = null;
+            slab_link(slab_classes[c].partial,sl);
+        }
+        // shared full slab isn't in any list until an object is returned to it
+        while(so->full[c] != null){
+            slab* sl = so->full[c];
+            slab_unlink(so->full[c],sl);
+            sl->owner = null;
+        }
+        void* r = owner_remote_take(so,c);
+        while(r != null){
+            void* nr = *((void**)r);
+            slab_free_locked(c,r);
+            r = nr;
+        }
+        unlock_slab_class(c);
+    }
+    global_lock();
+    so->next = slab_owners_unused;
+    slab_owners_unused = so;
+    global_unlock();
+}
+
+// flush whole thread cache when thread exits
+static void tcache_destroy(void* v){
+    for(uint8_t c = 0; c < CACHE_CLASS_COUNT; ++c){
+        if(tcache.count[c] > 0)
+            tcache_flush(c,tcache.count[c]);
+    }
+    slab_owner_release(tcache.owner);
+    tcache.owner = null;
+    tcache.state = TCACHE_DEAD;
+}
+
+static void tcache_key_init(){
+    pthread_key_create(&tcache_key,tcache_destroy);
+}
+
+// check if thread cache can be used setting it up on first use
+// pthread might allocate memory during set up so thread cache isn't used meanwhile
+static inline bool cache_active(){
+    if(tcache.state == TCACHE_ACTIVE)
+        return true;
+    if(tcache.state != TCACHE_NONE)
+        return false;
+    tcache.state = TCACHE_INIT;
+    tcache.owner = slab_owner_new();
+    if(tcache.owner == null){
+        tcache.state = TCACHE_DEAD;
+        return false;
+    }
+    pthread_once(&tcache_once,tcache_key_init);
+    // destructor is only called for threads with non null value
+    pthread_setspecific(tcache_key,&tcache);
+    tcache.state = TCACHE_ACTIVE;
+    return true;
+}
+
+// push object to thread cache list of size class c
+// half of the list is flushed if it's full
+static inline bool cache_push(uint8_t c, void* p){
+    if(!cache_active())
+        return false;
+    if(tcache.count[c] >= TCACHE_DEPTH)
+        tcache_flush(c,CACHE_BATCH);
+    *((void**)p) = tcache.head[c];
+    tcache.head[c] = p;
+    ++tcache.count[c];
+    return true;
+}
+
+// slab owner of thread cache
+#define cache_owner() (tcache.owner)
+
+// pop object from thread cache list of size class c
+static inline void* cache_pop(uint8_t c){
+    void* p = tcache.head[c];
+    if(p != null){
+        tcache.head[c] = *((void**)p);
+        --tcache.count[c];
+    }
+    return p;
+}
+
+// allocate object of size class c from owned slabs and fill thread cache with a batch of them
+// objects freed by other threads come first
+static inline void* cache_fill_slab(uint8_t c){
+    slab_owner* so = tcache.owner;
+    void* o = null;
+    uint32_t freed = 0;
+    void* r = owner_remote_take(so,c);
+    while(r != null){
+        void* nr = *((void**)r);
+        if(ptr_slab(r)->owner != so){
+            // pushed before record was given to this thread
+            slab_free(c,r);
+        }else if(o == null){
+            o = r;
+        }else if(tcache.count[c] < TCACHE_DEPTH){
+            *((void**)r) = tcache.head[c];
+            tcache.head[c] = r;
+            ++tcache.count[c];
+        }else{
+            owner_free(c,so,r);
+            ++freed;
+        }
+        r = nr;
+    }
+    if(freed > 0)
+        __atomic_sub_fetch(&(slab_classes[c].used),freed,__ATOMIC_RELAXED);
+    if(o == null)
+        o = owner_free_stack_pop(c,so);
+    if(o != null)
+        return o;
+    o = owner_alloc(c,so);
+    uint32_t n = 1;
+    for(; o != null && n < CACHE_BATCH; ++n){
+        void* no = owner_alloc(c,so);
+        if(no == null)
+            break;
+        *((void**)no) = tcache.head[c];
+        tcache.head[c] = no;
+        ++tcache.count[c];
+    }
+    if(o != null)
+        __atomic_add_fetch(&(slab_classes[c].used),n,__ATOMIC_RELAXED);
+    return o;
+}
+
+// fill thread cache with a batch of blocks of size class c from quick list of freelist fi
+// freelist lock must be held
+static inline void cache_fill_quick(uint8_t fi, uint8_t c){
+    for(uint32_t i = 1; i < CACHE_BATCH; ++i){
+        memory_block* b = quick_pop(fi,size_classes[c]);
+        if(b == null)
+            break;
+        void* p = block_data(b);
+        *((void**)p) = tcache.head[c];
+        tcache.head[c] = p;
+        ++tcache.count[c];
+    }
+}
+#endif
+
+// cut block of size s from the start of top block
+// remainder that is less than MIN_BLOCK_SIZE is cut with it leaving top block empty
+// global lock must be held
+static inline memory_block* top_alloc(size_t s){
+    if(heap_top == null || heap_top_size < s)
+        return null;
+    if(heap_top_size - s < min_block_size)
+        s = heap_top_size;
+    memory_block* b = heap_top;
+    heap_top = shift_block_ptr(b,+s);
+    heap_top->size = heap_top_size | (BLOCK_TOP_TAG << BLOCK_FREE_SHIFT);
+    block_update(b, BLOCK_SIZE_MASK|BLOCK_FREE_MASK, s);
+    return b;
+}
+
+// push used block b to remote free queue of freelist fi
+static inline void remote_push(uint8_t fi, memory_block* b){
+    remote_queue* q = &(remote_queues[fi/2]);
+    __atomic_store_n(&(b->next),null,__ATOMIC_RELAXED);
+    memory_block* prev = __atomic_exchange_n(&(q->head),b,__ATOMIC_ACQ_REL);
+    __atomic_store_n(&(prev->next),b,__ATOMIC_RELEASE);
+}
+
+// make chunk c current one, what's left of top block of the previous one is freed
+// global lock must be held
+static inline void heap_switch(memory_block* c){
+    memory_block* t = heap_top;
+    heap_top = c;
+    heap_end = chunk_fence(c);
+    heap_top->size = heap_top_size | (BLOCK_TOP_TAG << BLOCK_FREE_SHIFT);
+    heap_top_stamp = 0;
+    if(t == null)
+        return;
+    if(t == chunk_start(t)){
+        // whole previous chunk was free
+        heap_size -= CHUNK_SIZE;
+        chunk_unmap(t);
+    }else if(block_size(t) == 0){
+        // empty top block was fence of previous chunk
+        block_update(t, BLOCK_FREE_MASK, 0);
+    }else{
+        // freelist lock can't be taken while holding global lock so block is returned
+        // through remote free queue of home freelist
+        block_update(t, BLOCK_FREE_MASK, 0);
+        remote_push(freelist_home == FREELIST_NONE ? 0 : freelist_home,t);
+    }
+}
+
+#ifdef HEAP_PREDICT
+// bytes top block should have to last for next HEAP_PREDICT_TIME at the rate it was used
+// since heap last grew, blocks merged back into it don't count. rate isn't trusted for
+// less than a tenth of that time
+// global lock must be held
+static inline size_t heap_predict(){
+    uint64_t t = heap_clock() - heap_grown_at;
+    if(t < HEAP_PREDICT_TIME/10)
+        t = HEAP_PREDICT_TIME/10;
+    return (size_t)((double)heap_cut * HEAP_PREDICT_TIME / t);
+}
+#endif
+
+// map new chunk and make it current one unless spare is set in which case new chunk
+// is kept in it. only one thread grows heap at once and mmap is called without global
+// lock so that top block can be used meanwhile
+// global lock must be held, it's released while heap is grown
+static inline bool grow_heap(bool spare){
+#ifdef HEAP_PREDICT
+    // chunk mapped ahead of demand
+    if(!spare && heap_spare != null){
+        heap_switch(heap_spare);
+        heap_spare = null;
+        heap_cut = 0;
+        heap_grown_at = heap_clock();
+        return true;
+    }
+#endif
+    heap_growing = 1;
+    global_unlock();
+    memory_block* c = chunk_map();
+    global_lock();
+    if(c != null){
+        heap_size += CHUNK_SIZE;
+#ifdef HEAP_PREDICT
+        if(spare)
+            heap_spare = c;
+        else{
+            heap_switch(c);
+            heap_cut = 0;
+            heap_grown_at = heap_clock();
+        }
+#else
+        heap_switch(c);
+#endif
+    }
+    // let threads waiting for heap to grow try again
+    heap_growing = 0;
+    futex_wake(&heap_growing,INT32_MAX);
+    return c != null;
+}
+
+// cut block of size s from top block growing heap if needed
+// threads that need heap to grow while other thread grows it wait for it and try again
+// global lock must be held, it might be released meanwhile
+static inline memory_block* heap_alloc(size_t s){
+    while(1){
+        memory_block* b = top_alloc(s);
+        if(b != null){
+#ifdef HEAP_PREDICT
+            // map next chunk ahead of demand so that next allocations don't wait for it
+            heap_cut += block_size(b);
+            if(!heap_growing && heap_spare == null && heap_top_size < heap_predict())
+                grow_heap(true);
+#endif
+            return b;
+        }
+        if(!heap_growing){
+            if(!grow_heap(false))
+                return null;
+            continue;
+        }
+        global_unlock();
+        while(__atomic_load_n(&heap_growing,__ATOMIC_ACQUIRE) != 0)
+            futex_wait(&heap_growing,1);
+        global_lock();
+    }
+}
+
+// give current chunk back to the operating system if it's empty and isn't the only one
+// global lock must be held
+static inline void shrink_heap(){
+    if(heap_top == null || heap_top != chunk_start(heap_top) || heap_size <= CHUNK_SIZE || heap_growing)
+        return;
+    heap_size -= CHUNK_SIZE;
+    chunk_unmap(heap_top);
+    heap_top = null;
+    heap_end = null;
+    heap_top_stamp = 0;
+}
+
+// purge pages of top block if nothing was merged into it for PURGE_DECAY_TIME or if force is set
+// first pad bytes of top block stay
+// global lock must be held
+static inline bool heap_purge(uint64_t now, bool force, size_t pad){
+    if(heap_top == null || heap_top_stamp == 0 || (!force && now - heap_top_stamp < purge_decay_time))
+        return false;
+    heap_top_stamp = 0;
+    if(pad > heap_top_size)
+        return false;
+    return purge_range(byte_ptr(heap_top) + sizeof(size_t) + pad,byte_ptr(heap_end));
+}
+
+// purge pages of freelist fi that outlived their share of decay curve, oldest first.
+// blocks freed before last PURGE_STEPS steps are always purged and blocks freed
+// in the current step never are unless force is set in which case all are purged
+// freelist lock must be held
+static bool freelist_purge(uint8_t fi, uint64_t now, bool force){
+    freelist_state* st = &(freelist_states[fi/2]);
+    block_index* ix = freelist_index(fi);
+    uint64_t n = purge_step_of(now);
+    purge_count(fi,now,0);
+    st->purge_step = n;
+    double limit = 0;
+    for(uint64_t k = 0; k < PURGE_STEPS && !force; ++k){
+        double x = (double)k/PURGE_STEPS;
+        limit += st->purge_freed[(n - k) % PURGE_STEPS] * (1 - x*x*(3 - 2*x));
+    }
+    size_t dirty = 0;
+    for(size_t i = 0; i < ix->count; ++i){
+        if(ix->sizes[i] >= PURGE_MIN_SIZE && ix->blocks[i]->stamp != 0)
+            dirty += ix->sizes[i];
+    }
+    bool purged = false;
+    for(uint64_t k = PURGE_STEPS; k > 0 && dirty > 0 && (k == PURGE_STEPS || dirty > limit); --k){
+        for(size_t i = 0; i < ix->count && (k == PURGE_STEPS || dirty > limit); ++i){
+            memory_block* b = ix->blocks[i];
+            if(ix->sizes[i] < PURGE_MIN_SIZE || b->stamp == 0)
+                continue;
+            if(!force && n - purge_step_of(b->stamp) < k)
+                continue;
+            purged |= purge_block(b);
+            dirty -= ix->sizes[i];
+        }
+    }
+    return purged;
+}
+
+// return used block b to freelist fi
+// freelist lock must be held
+static inline void free_block(uint8_t fi, memory_block* b){
+    // small blocks are kept unmerged in quick lists
+    if(block_size(b) <= QUICK_MAX_SIZE){
+        quick_push(fi,b);
+        return;
+    }
 
     // add removed block into freelist
-    uint8_t fi;
-    fi = freelist_lock_any();
-    add_block(fi,b);
+    b = add_block(fi,b);
 
-    // give last memory block that isn't needed back to the operating system
-    b = freelist_end(fi)->prev;
+    // free pages are checked for purging once per decay step unless background thread does it
+    uint64_t now = heap_clock();
+    if(!bg_active() && purge_step_of(now) != freelist_states[fi/2].purge_step){
+        freelist_purge(fi,now,false);
+        global_lock();
+        heap_purge(now,false,0);
+        global_unlock();
+    }
+
+    // give current chunk back to the operating system if it's empty
+    // quick lists are merged first as some of their blocks might be adjacent to top block
     global_lock();
-    if(block_end(b) == heap_end){
-        intptr_t inc = b->size;
-        if(inc >= GIVE_BACK_SIZE){
-            if(b == heap_start){
-                if(inc > GIVE_BACK_SIZE){
-                    inc = inc - GIVE_BACK_SIZE;
-                    sbrk(-inc);
-                    b->size = GIVE_BACK_SIZE;
-                }
-            }else{
+    bool trim = b != null && b == heap_top && heap_size > CHUNK_SIZE &&
+        heap_top_size + freelist_states[fi/2].quick_size >= CHUNK_SIZE - sizeof(size_t);
+    global_unlock();
+    if(trim){
+        quick_consolidate(fi);
+        global_lock();
+        shrink_heap();
+        global_unlock();
+    }
+}
+
+// pop block from remote free queue of freelist fi
+// null is returned if queue is empty or the next block is still being linked by its producer
+// freelist lock must be held
+static inline memory_block* remote_pop(uint8_t fi){
+    remote_queue* q = &(remote_queues[fi/2]);
+    memory_block* tail = q->tail;
+    memory_block* next = __atomic_load_n(&(tail->next),__ATOMIC_ACQUIRE);
+    if(tail == &(q->stub)){
+        if(next == null)
+            return null;
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&(tail->next),__ATOMIC_ACQUIRE);
+    }
+    if(next != null){
+        q->tail = next;
+        return tail;
+    }
+    // tail is the last block, stub is pushed behind it so that it can be taken
+    if(tail != __atomic_load_n(&(q->head),__ATOMIC_ACQUIRE))
+        return null;
+    remote_push(fi,&(q->stub));
+    next = __atomic_load_n(&(tail->next),__ATOMIC_ACQUIRE);
+    if(next != null){
+        q->tail = next;
+        return tail;
+    }
+    return null;
+}
+
+// return all blocks from remote free queue of freelist fi to it
+// freelist lock must be held
+static inline void remote_drain(uint8_t fi){
+    memory_block* b;
+    while((b = remote_pop(fi)) != null)
+        free_block(fi,b);
+}
+
+// find freelist used block b should be returned to
+// freelist of adjacent free block is preferred so that they can be merged, otherwise
+// it goes to home freelist of current thread. tags are read without any lock so the
+// result is only a hint
+static inline uint8_t block_home(memory_block* b){
+    size_t tag = block_prev_free_tag(b);
+    if(tag != 0 && tag <= freelist_count)
+        return tag_freelist(tag);
+    memory_block* rb = block_end(b);
+    tag = block_free_tag(rb);
+    if(tag != 0 && tag <= freelist_count)
+        return tag_freelist(tag);
+    return home_freelist();
+}
+
+// allocate block of size ns from freelist fi
+// freelist lock must be held
+static inline memory_block* freelist_alloc(uint8_t fi, size_t ns, bool cached){
+    // blocks freed by other threads while freelist was locked
+    remote_drain(fi);
+    // recently freed block of the same size class
+    memory_block* block = null;
+    if(ns <= QUICK_MAX_SIZE){
+        block = quick_pop(fi,ns);
+        if(block != null && cached)
+            cache_fill_quick(fi,size_class(ns));
+    }
+    // find free memory block
+    if(block == null)
+        block = find_suitable_block(fi,ns);
+    // merge quick lists and try again
+    if(block == null && freelist_states[fi/2].quick_size > 0){
+        quick_consolidate(fi);
+        block = find_suitable_block(fi,ns);
+    }
+    // merge blocks left next to free blocks of other freelists and try again
+    if(block == null && freelist_states[fi/2].unmerged > 0){
+        freelist_merge(fi);
+        block = find_suitable_block(fi,ns);
+    }
+    return block;
+}
+
+// mmap cache
+// released mmap blocks are kept mapped in buckets by size class of their page count so
+// that later large requests reuse them instead of mapping and faulting in fresh pages.
+// blocks of a bucket are kept oldest first, full bucket gives up its oldest block and
+// blocks that stay in cache for PURGE_DECAY_TIME are unmapped.
+// mmap blocks keep their page rounded length in size and stay in page map while cached
+typedef struct {
+    memory_block* blocks[MMAP_CACHE_DEPTH];
+    uint64_t stamps[MMAP_CACHE_DEPTH]; // time block was cached
+    uint32_t count;
+} mmap_bucket;
+static mmap_bucket mmap_cache[SIZE_CLASS_COUNT];
+static size_t mmap_cache_size = 0; // bytes in cache
+static uint64_t mmap_cache_step = 0; // decay step cache was last checked at
+static uint64_t mmap_cache_hits = 0;
+static uint64_t mmap_cache_misses = 0;
+static size_t mmap_released_size = 0; // length of block unmapped last, 0 once it raised threshold
+static uint64_t mmap_released_time = 0; // time it was taken out of cache
+#define mmap_length(s) (((s) + PAGE_MAP_PAGE - 1) & ~(PAGE_MAP_PAGE - 1))
+
+// take i-th block out of bucket bk
+static inline memory_block* mmap_bucket_take(mmap_bucket* bk, uint32_t i){
+    memory_block* b = bk->blocks[i];
+    for(--bk->count; i < bk->count; ++i){
+        bk->blocks[i] = bk->blocks[i+1];
+        bk->stamps[i] = bk->stamps[i+1];
+    }
+    mmap_cache_size -= b->size;
+    return b;
+}
+
+// take cached block of at least s bytes, most recently cached first
+// blocks of the same size are pushed into bucket found rounding down so it's checked
+// first and then the one found rounding up where any block fits. mmap lock must be held
+static inline memory_block* mmap_cache_pop(size_t s){
+    unsigned int c = size_class(s);
+    unsigned int lc = c < SIZE_CLASS_COUNT && size_classes[c] > s && c > 0 ? c - 1 : c;
+    for(; lc <= c && lc < SIZE_CLASS_COUNT; ++lc){
+        mmap_bucket* bk = &(mmap_cache[lc]);
+        for(uint32_t i = bk->count; i > 0; --i){
+            if(bk->blocks[i-1]->size >= s){
+                ++mmap_cache_hits;
+                return mmap_bucket_take(bk,i-1);
+            }
+        }
+    }
+    ++mmap_cache_misses;
+    return null;
+}
+
+// cache released block b, block that has to be unmapped instead is returned
+// mmap lock must be held
+static inline memory_block* mmap_cache_push(memory_block* b, uint64_t t){
+    // bucket is found rounding down so that any block of it fits requests of its size class
+    unsigned int c = size_class(b->size);
+    if(c < SIZE_CLASS_COUNT && size_classes[c] > b->size)
+        --c;
+    memory_block* ob = b;
+    if(c < SIZE_CLASS_COUNT){
+        mmap_bucket* bk = &(mmap_cache[c]);
+        size_t out = bk->count == MMAP_CACHE_DEPTH ? bk->blocks[0]->size : 0;
+        if(mmap_cache_size - out + b->size <= mmap_cache_max){
+            ob = out > 0 ? mmap_bucket_take(bk,0) : null;
+            bk->blocks[bk->count] = b;
+            bk->stamps[bk->count] = t;
+            ++bk->count;
+            mmap_cache_size += b->size;
+        }
+    }
+    if(ob != null){
+        mmap_released_size = ob->size;
+        mmap_released_time = t;
+    }
+    return ob;
+}
+
+// take blocks that stayed in cache for PURGE_DECAY_TIME out of it, all of them if force is set
+// they are returned as a list linked through next so that they're unmapped without the lock
+// mmap lock must be held
+static inline memory_block* mmap_cache_decay(uint64_t now, bool force){
+    memory_block* l = null;
+    mmap_cache_step = purge_step_of(now);
+    for(unsigned int c = 0; c < SIZE_CLASS_COUNT; ++c){
+        mmap_bucket* bk = &(mmap_cache[c]);
+        while(bk->count > 0 && (force || now - bk->stamps[0] >= purge_decay_time)){
+            memory_block* b = mmap_bucket_take(bk,0);
+            mmap_released_size = b->size;
+            mmap_released_time = now;
+            b->next = l;
+            l = b;
+        }
+    }
+    return l;
+}
+
+// unmap mmap blocks of list l
+static inline void mmap_unmap(memory_block* l){
+    while(l != null){
+        memory_block* nb = l->next;
+        page_map_set(l,1,PAGE_NONE);
+        if(!bg_push(l,l->size))
+            munmap(l,l->size);
+        l = nb;
+    }
+}
+
+// raise mmap threshold past length s of mmap request that missed the cache at time now
+// if block of its size class was unmapped within decay time, unless threshold was set
+// explicitly. requests of that size class are cut from heap from then on
+// mmap lock must be held
+static inline void mmap_threshold_adjust(size_t s, uint64_t now){
+    if(mmap_released_size == 0 || now - mmap_released_time > purge_decay_time ||
+        size_class(s) != size_class(mmap_released_size))
+        return;
+    mmap_released_size = 0;
+    if(__atomic_load_n(&mmap_threshold_fixed,__ATOMIC_RELAXED) ||
+        s <= __atomic_load_n(&mmap_threshold,__ATOMIC_RELAXED) || s > mmap_threshold_max)
+        return;
+    __atomic_store_n(&mmap_threshold,find_optimal_memory_size(s) + 1,__ATOMIC_RELAXED);
+}
+
+// allocate block of s bytes with mmap, released block of the same size is reused if cached
+static inline void* mmap_alloc(size_t s){
+    size_t ms = mmap_length(s);
+    uint64_t now = heap_clock();
+    lock_mmap();
+    memory_block* b = mmap_cache_pop(ms);
+    if(b != null)
+        mmap_size += b->size;
+    else
+        mmap_threshold_adjust(ms,now);
+    unlock_mmap();
+    if(b != null)
+        return block_data(b);
+    void* m = mmap(NULL,ms,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if(m == MAP_FAILED)
+        return null;
+    b = (memory_block*)m;
+    b->size = ms;
+    if(!page_map_set(b,1,PAGE_MMAP)){
+        munmap(b,ms);
+        return null;
+    }
+    lock_mmap();
+    mmap_size += ms;
+    unlock_mmap();
+    return block_data(b);
+}
+
+void* malloc(size_t s){
+    // check for 0 size
+    if(s == 0)
+        return null;
+
+    // small sizes are allocated from slabs through thread cache
+    if(s <= SLAB_MAX_SIZE){
+        uint8_t c = size_class(s);
+        void* o;
+        if(cache_active()){
+            o = cache_pop(c);
+            if(o == null)
+                o = cache_fill_slab(c);
+        }else
+            o = slab_alloc(s);
+        if(o != null)
+            return o;
+    }
+
+    // tunables are read before anything is cut from heap or mapped
+    conf_load();
+
+    // add size of size_t as we need to save size of memory block
+    s += sizeof(size_t);
+    // find suitable memory size
+    size_t ns = find_optimal_memory_size(s);
+
+    // recently freed block from thread cache
+    bool cached = ns <= CACHE_MAX_SIZE && size_class(ns) >= SLAB_CLASS_COUNT && cache_active();
+    if(cached){
+        void* p = cache_pop(size_class(ns));
+        if(p != null)
+            return p;
+    }
+
+    // if size is greater than or equals mmap threshold we are going to use mmap
+    if(ns >= __atomic_load_n(&mmap_threshold,__ATOMIC_RELAXED))
+        return mmap_alloc(s);
+
+    memory_block* block;
+    // home freelist first
+    uint8_t fh = home_freelist();
+    lock_freelist(fh);
+    block = freelist_alloc(fh,ns,cached);
+    unlock_freelist(fh);
+    if(block != null)
+        return block_data(block);
+
+    // steal from other freelists that aren't busy
+    for(uint32_t j = 1; j < freelist_count; ++j){
+        uint8_t fi = (uint8_t)(((fh/2 + j) % freelist_count)*2);
+        if(!trylock_freelist(fi))
+            continue;
+        block = freelist_alloc(fi,ns,cached);
+        unlock_freelist(fi);
+        if(block != null)
+            return block_data(block);
+    }
+
+    // no free memory blocks found
+    // cut new block from top block growing heap if needed
+    global_lock();
+    block = heap_alloc(ns);
+    global_unlock();
+
+    if(block == null)
+        return null;
+    // shift pointer into data block pointer
+    return block_data(block);
+}
+
+// merge with adjacent block so that overall new size would be s
+// freelist of the adjacent block is found from its tag and locked
+static inline memory_block* merge_with_adjacent_block(memory_block* block, size_t s){
+
+    // right adjacent top block, cut the rest from it
+    memory_block* b = block_end(block);
+    size_t tag = block_free_tag(b);
+    if(tag == BLOCK_TOP_TAG){
+        global_lock();
+        if(b == heap_top && block_size(block) + heap_top_size >= s){
+            // remainder that is less than MIN_BLOCK_SIZE is taken too leaving top block empty
+            if(block_size(block) + heap_top_size - s < min_block_size)
+                s = block_size(block) + heap_top_size;
+            heap_top = shift_block_ptr(block,+s);
+            heap_top->size = heap_top_size | (BLOCK_TOP_TAG << BLOCK_FREE_SHIFT);
+            block_update(block, BLOCK_SIZE_MASK, s);
+            global_unlock();
+            return block;
+        }
+        global_unlock();
+    }else if(tag != 0){
+        // right adjacent
+        uint8_t fi = tag_freelist(tag);
+        lock_freelist(fi);
+        // block might have been taken before we locked its freelist
+        if(block_free_tag(b) == tag && block_size(block) + block_size(b) >= s){
+            block_unlink(b);
+            index_remove(freelist_index(fi),b);
+            block_update(block, BLOCK_SIZE_MASK, block_size(block) + block_size(b));
+            mark_block_used(block);
+            split_used_block(fi,block,s);
+            unlock_freelist(fi);
+            return block;
+        }
+        unlock_freelist(fi);
+    }
+
+    // left adjacent
+    // code is slightly more complex as we need to copy data over
+    tag = block_prev_free_tag(block);
+    if(tag != 0){
+        uint8_t fi = tag_freelist(tag);
+        lock_freelist(fi);
+        if(block_prev_free_tag(block) == tag){
+            b = block_left(block);
+            size_t bs = block_size(b) + block_size(block);
+            if(bs >= s){
                 block_unlink(b);
-                sbrk(-inc);
-                heap_size -= inc;
-                heap_end = shift_block_ptr(heap_end,-inc);
-                heap_start = shift_block_ptr(heap_end,-heap_size);
+                index_remove(freelist_index(fi),b);
+                // blocks might overlap so we need to use memmove
+                // after that block header might be overwritten
+                memmove(block_data(b),block_data(block), block_size(block) - sizeof(size_t));
+                block_update(b, BLOCK_SIZE_MASK|BLOCK_FREE_MASK, bs);
+                split_used_block(fi,b,s);
+                unlock_freelist(fi);
+                return b;
             }
         }
+        unlock_freelist(fi);
+    }
+
+    return null;
+}
+
+void* realloc(void* p, size_t s){
+    if(p == null){
+        return malloc(s);
+    }else if(s == 0){
+        free(p);
+        return null;
+    }
+
+    // heap pointers are classified with range check and others using page map
+    uint8_t k = heap_contains(p) ? PAGE_HEAP : page_map_get(p);
+    if(k == PAGE_NONE)
+        return null;
+
+    // objects from slabs are moved if they don't fit anymore
+    if(k >= PAGE_SLAB){
+        size_t os = size_classes[k-PAGE_SLAB];
+        if(s <= os)
+            return p;
+        void* np = malloc(s);
+        if(np != null){
+            memcpy(np,p,os);
+            free(p);
+        }
+        return np;
+    }
+
+    // shift pointer back into memory block pointer
+    memory_block* b = data_block(p);
+
+    // find out which new optimal size we need
+    size_t ss = s+sizeof(size_t);
+    size_t ns = find_optimal_memory_size(ss);
+
+    // if memory is mmap we need to use mremap
+    // shrunk tail is unmapped in place and block is only moved if it can't be extended
+    if(k == PAGE_MMAP){
+        size_t os = b->size;
+        ss = mmap_length(ss);
+        if(ss == os)
+            return p;
+        // old range of moved block might be mapped by another thread as soon as mremap
+        // returns so page map entry of growing block is cleared before and set after it
+        bool grow = ss > os;
+        if(grow)
+            page_map_set(b,1,PAGE_NONE);
+        void* m = mremap(b,os,ss,grow ? MREMAP_MAYMOVE : 0);
+        if(m == MAP_FAILED){
+            if(grow)
+                page_map_set(b,1,PAGE_MMAP);
+            return null;
+        }
+        // if moved block can't be registered it's leaked on free
+        if(grow)
+            page_map_set(m,1,PAGE_MMAP);
+        lock_mmap();
+        mmap_size = (mmap_size - os) + ss;
+        unlock_mmap();
+        b = (memory_block*)m;
+        b->size = ss;
+        return block_data(b);
+    }
+
+    // check if size is already sufficient
+    // tail of shrunk block goes back to home freelist merged with free blocks next to it so
+    // that it can be reused, its pages decay like those of any other free block
+    if(block_size(b) >= ns){
+        if(block_size(b) - ns >= min_block_size){
+            uint8_t fh = home_freelist();
+            lock_freelist(fh);
+            split_used_block(fh,b,ns);
+            unlock_freelist(fh);
+        }
+        return p;
+    }
+
+    // try merging with adjacent blocks before moving
+    // block may grow past mmap threshold this way as long as it still fits a chunk
+    if(merge_adj_on_realloc && ns <= mmap_threshold_max){
+        memory_block* nb = merge_with_adjacent_block(b,ns);
+        if(nb != null){
+            // shift pointer into data block pointer
+            return block_data(nb);
+        }
+    }
+
+    // block that has to move goes to mmap if it's at least MMAP_SIZE even if mmap threshold
+    // rose since, mapped block then grows with mremap without being copied again. threshold
+    // that was set explicitly is used as is
+    size_t mt = __atomic_load_n(&mmap_threshold_fixed,__ATOMIC_RELAXED) ?
+        __atomic_load_n(&mmap_threshold,__ATOMIC_RELAXED) : MMAP_SIZE;
+    void* np = ns >= mt ? mmap_alloc(ss) : malloc(s);
+    if(np != null){
+        // copy old data block into new one
+        size_t bs = block_size(b) - sizeof(size_t);
+        memcpy(np,p,s > bs ? bs : s);
+
+        // free old data block
+        free(p);
+
+        // return newly allocated block
+        return np;
+    }
+    
+    return null;
+}
+
+#ifdef BACKGROUND_THREAD
+// unmap blocks queued for background thread
+static void bg_drain(){
+    memory_block* l = __atomic_exchange_n(&bg_queue,null,__ATOMIC_ACQUIRE);
+    while(l != null){
+        memory_block* nb = l->next;
+        size_t s = CHUNK_SIZE;
+        if(heap_contains(l))
+            chunk_release(l);
+        else{
+            s = l->size;
+            munmap(l,s);
+        }
+        __atomic_sub_fetch(&bg_pending,s,__ATOMIC_RELAXED);
+        l = nb;
+    }
+}
+
+// drain remote free queues, merge blocks left unmerged, purge free pages and decay mmap cache
+static void bg_maintain(uint64_t now){
+    for(uint8_t i = 0; i < freelist_count; ++i){
+        uint8_t fi = i*2;
+        lock_freelist(fi);
+        remote_drain(fi);
+        if(freelist_states[i].unmerged > 0)
+            freelist_merge(fi);
+        freelist_purge(fi,now,false);
+        unlock_freelist(fi);
     }
+    global_lock();
+    heap_purge(now,false,0);
     global_unlock();
+    lock_mmap();
+    memory_block* l = mmap_cache_decay(now,false);
+    unlock_mmap();
+    mmap_unmap(l);
+}
+
+static void* bg_main(void* arg){
+    struct timespec ts = { (purge_decay_time/PURGE_STEPS)/1000000000, (purge_decay_time/PURGE_STEPS)%1000000000 };
+    while(1){
+        // woken up when blocks are queued and once per decay step
+        syscall(SYS_futex,&bg_signal,FUTEX_WAIT_PRIVATE,0,&ts,null,0);
+        __atomic_store_n(&bg_signal,0,__ATOMIC_RELAXED);
+        uint64_t now = heap_clock();
+        if(purge_step_of(now) != bg_step){
+            bg_step = purge_step_of(now);
+            bg_maintain(now);
+        }
+        bg_drain();
+    }
+    return null;
+}
+
+// background thread doesn't survive fork so child starts its own
+static void bg_child(){
+    bg_state = BG_NONE;
+}
+
+// start background thread, it's created with all signals blocked
+static void bg_create(){
+    uint32_t st = BG_NONE;
+    if(!__atomic_compare_exchange_n(&bg_state,&st,BG_STARTING,false,__ATOMIC_ACQ_REL,__ATOMIC_RELAXED))
+        return;
+    static bool bg_atfork = false;
+    if(!bg_atfork)
+        bg_atfork = pthread_atfork(null,null,bg_child) == 0;
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK,&all,&old);
+    pthread_attr_t at;
+    pthread_attr_init(&at);
+    pthread_attr_setdetachstate(&at,PTHREAD_CREATE_DETACHED);
+    pthread_t t;
+    int r = pthread_create(&t,&at,bg_main,null);
+    pthread_attr_destroy(&at);
+    pthread_sigmask(SIG_SETMASK,&old,null);
+    __atomic_store_n(&bg_state,r == 0 ? BG_RUNNING : BG_FAILED,__ATOMIC_RELEASE);
+}
+
+static inline void bg_start(){
+    if(__atomic_load_n(&bg_state,__ATOMIC_RELAXED) == BG_NONE)
+        bg_create();
+}
+#else
+#define bg_drain()
+#define bg_start()
+#endif
+
+void free(void* p){
+    // check for null pointer
+    if(p == null)
+        return;
+
+    // heap pointers are classified with range check and others using page map
+    uint8_t k = heap_contains(p) ? PAGE_HEAP : page_map_get(p);
+
+    // return small object to thread cache or its slab
+    if(k >= PAGE_SLAB){
+        uint8_t c = k-PAGE_SLAB;
+        // object carved by another cache goes back to its owner, reusing it here would
+        // make this thread share cache line with objects still used by the owner
+        if(!cache_active() || ptr_slab(p)->owner != cache_owner() || !cache_push(c,p))
+            slab_free(c,p);
+        return;
+    }
+
+    // background thread is started once there's work for it
+    bg_start();
+
+    // shift pointer back into memory block pointer
+    memory_block* b = data_block(p);
+
+    // released mmap block is cached and cache is checked for idle blocks once per decay step
+    if(k == PAGE_MMAP){
+        uint64_t now = heap_clock();
+        lock_mmap();
+        mmap_size -= b->size;
+        memory_block* l = mmap_cache_push(b,now);
+        if(l != null)
+            l->next = null;
+        if(!bg_active() && purge_step_of(now) != mmap_cache_step){
+            memory_block* d = mmap_cache_decay(now,false);
+            if(l != null)
+                l->next = d;
+            else
+                l = d;
+        }
+        unlock_mmap();
+        mmap_unmap(l);
+        return;
+    }
+
+    // pointer isn't ours
+    if(k != PAGE_HEAP)
+        return;
+
+    // small blocks go to thread cache
+    if(block_size(b) <= CACHE_MAX_SIZE){
+        uint8_t c = quick_class(block_size(b));
+        if(c >= SLAB_CLASS_COUNT && cache_push(c,p))
+            return;
+    }
+
+    // don't wait for lock of the freelist, its holder returns the block later
+    uint8_t fi = block_home(b);
+    if(!trylock_freelist(fi)){
+        remote_push(fi,b);
+        return;
+    }
+    remote_drain(fi);
+    free_block(fi,b);
     unlock_freelist(fi);
 }
 
@@ -543,30 +2943,219 @@ void* calloc(size_t nmemb, size_t size){
     return p;
 }
 
+// give free pages back to the operating system now instead of letting them decay
+// first pad bytes of top block stay resident, 1 is returned if anything was given back
+int malloc_trim(size_t pad){
+    bool trimmed = false;
+    uint64_t now = heap_clock();
+    for(uint8_t i = 0; i < freelist_count; ++i){
+        uint8_t fi = i*2;
+        lock_freelist(fi);
+        remote_drain(fi);
+        quick_consolidate(fi);
+        trimmed |= freelist_purge(fi,now,true);
+        unlock_freelist(fi);
+    }
+    global_lock();
+    size_t hs = heap_size;
+    shrink_heap();
+    trimmed |= hs != heap_size;
+    trimmed |= heap_purge(now,true,pad);
+    global_unlock();
+    lock_mmap();
+    memory_block* l = mmap_cache_decay(now,true);
+    unlock_mmap();
+    trimmed |= l != null;
+    mmap_unmap(l);
+    // work queued for background thread is done right away
+    bg_drain();
+    return trimmed;
+}
+
+// change tunables at run time, parameters are those of glibc that make sense here
+// M_MMAP_THRESHOLD sets mmap threshold and turns off its adjustment and M_ARENA_MAX
+// sets number of freelists if they aren't set up yet, 1 is returned on success
+int mallopt(int param, int value){
+    conf_load();
+    if(param == M_MMAP_THRESHOLD && value >= 0 && (size_t)value <= CHUNK_SIZE/2){
+        __atomic_store_n(&mmap_threshold_fixed,true,__ATOMIC_RELAXED);
+        __atomic_store_n(&mmap_threshold,(size_t)value,__ATOMIC_RELAXED);
+        return 1;
+    }
+    if(param == M_ARENA_MAX && value > 0){
+        global_lock();
+        bool set = freelist_count == 0;
+        if(set)
+            freelist_max = value > FREELIST_SIZE ? FREELIST_SIZE : (uint32_t)value;
+        global_unlock();
+        return set;
+    }
+    return 0;
+}
+
+// debug output made while holding locks is collected in a fixed buffer and printed
+// after unlocking as printf may need to malloc stdout buffer, output that doesn't fit is cut
+#define PRINT_BUFFER_SIZE 65536
+typedef struct {
+    size_t len;
+    char data[PRINT_BUFFER_SIZE];
+} print_buffer;
+
+// append formatted output to print buffer pb
+static void print_buffered(print_buffer* pb, const char* format, ...){
+    if(pb->len >= PRINT_BUFFER_SIZE - 1)
+        return;
+    va_list args;
+    va_start(args,format);
+    int n = vsnprintf(pb->data + pb->len,PRINT_BUFFER_SIZE - pb->len,format,args);
+    va_end(args);
+    if(n > 0)
+        pb->len = pb->len + n < PRINT_BUFFER_SIZE - 1 ? pb->len + n : PRINT_BUFFER_SIZE - 1;
+}
+
+// print and empty print buffer pb, no lock may be held
+static void print_flush(print_buffer* pb){
+    fwrite(pb->data,1,pb->len,stdout);
+    if(pb->len == PRINT_BUFFER_SIZE - 1)
+        printf(" -> output cut\n");
+    pb->len = 0;
+}
+
 void print_block_info(void* p){
     // shift pointer back into memory block pointer
     memory_block* b = data_block(p);
     print_block(b);
 }
 
+#ifdef LOCK_STATS
+// print acquisitions, contended acquisitions and wait time in us of n locks together
+static void print_lock_stats(const char* name, alock* l, size_t n){
+    uint64_t acquired = 0, contended = 0, wait_time = 0;
+    for(size_t i = 0; i < n; ++i){
+        acquired += l[i].acquired;
+        contended += l[i].contended;
+        wait_time += l[i].wait_time;
+    }
+    printf(" -> %s[%lu|%lu|%lu]",name,acquired,contended,wait_time/1000);
+}
+#endif
+
+#ifdef HEAP_HUGEPAGE
+// bytes of heap chunks and slab region backed by huge pages as reported by /proc/self/smaps
+// file is parsed with plain read so that nothing is allocated meanwhile
+static size_t huge_size(){
+    int fd = open("/proc/self/smaps",O_RDONLY);
+    if(fd < 0)
+        return 0;
+    char buf[4096];
+    char line[256];
+    size_t n = 0, total = 0;
+    bool ours = false;
+    ssize_t r;
+    while((r = read(fd,buf,sizeof(buf))) > 0){
+        for(ssize_t i = 0; i < r; ++i){
+            if(buf[i] != '\n'){
+                if(n < sizeof(line) - 1)
+                    line[n++] = buf[i];
+                continue;
+            }
+            line[n] = 0;
+            n = 0;
+            char* e;
+            uint8_t* p = (uint8_t*)strtoul(line,&e,16);
+            if(*e == '-'){
+                // mapping header, fields that follow belong to this mapping
+                ours = heap_contains(p) || (p >= slab_region_start && p < slab_region_end);
+            }else if(ours && strncmp(line,"AnonHugePages:",14) == 0)
+                total += strtoul(line + 14,null,10)*1024;
+        }
+    }
+    close(fd);
+    return total;
+}
+#endif
+
 void print_freelist(){
-    global_lock();
-    printf("[heap size %d mb mmap_size %d mb freelists %d] ",(heap_size/(1024*1024)),(mmap_size/(1024*1024)),FREELIST_SIZE);
+    print_buffer pb;
+    pb.len = 0;
+    // header is printed before locking as first printf may need to malloc stdout buffer
+    printf("[heap size %lu mb mmap_size %lu mb top size %lu kb freelists %u] ",(heap_size/(1024*1024)),(mmap_size/(1024*1024)),heap_top == null ? 0 : heap_top_size/1024,freelist_count);
+    // freelists are locked before global lock as everywhere else
     freelist_lock_all();
-    for(uint8_t i = 0; i < FREELIST_SIZE; ++i){
-        printf("freelist %d {",i);
+    global_lock();
+    for(uint8_t i = 0; i < freelist_count; ++i){
+        print_buffered(&pb,"freelist %d index %lu|%lu {",i,freelist_states[i].index.count-freelist_states[i].index.holes,freelist_states[i].index.holes);
         memory_block* b = freelist_start(i*2);
         while(b != freelist_end(i*2)){
-            printf(" -> %p[%lu|%p|%p]",b,b->size,b->prev,b->next);    
+            print_buffered(&pb," -> %p[%lu|%p|%p]",b,block_size(b),b->prev,b->next);
             // detect infinite loop if any
             if(b == b->next){
-                printf(" -> infinite loop\n");
+                print_buffered(&pb," -> infinite loop\n");
                 break;
             }
             b = b->next;
         }
-        printf(" }\n");
+        print_buffered(&pb," }\n");
+        print_buffered(&pb,"quick %d {",i);
+        for(uint8_t c = 0; c < QUICK_CLASS_COUNT; ++c){
+            unsigned int n = 0;
+            for(b = freelist_states[i].quick_lists[c]; b != null; b = b->next)
+                ++n;
+            if(n > 0)
+                print_buffered(&pb," -> %lu[%u]",size_classes[c],n);
+        }
+        print_buffered(&pb," }\n");
     }
-    unlock_all_freelists()
     global_unlock();
+    unlock_all_freelists()
+    print_flush(&pb);
+    lock_mmap();
+    print_buffered(&pb,"mmap threshold %lu kb%s mmap cache %lu mb hits %lu misses %lu {",mmap_threshold/1024,mmap_threshold_fixed ? " fixed" : "",mmap_cache_size/(1024*1024),mmap_cache_hits,mmap_cache_misses);
+    for(unsigned int c = 0; c < SIZE_CLASS_COUNT; ++c){
+        if(mmap_cache[c].count > 0)
+            print_buffered(&pb," -> %lu[%u]",size_classes[c],mmap_cache[c].count);
+    }
+    print_buffered(&pb," }\n");
+    unlock_mmap();
+    print_flush(&pb);
+    printf("slabs {");
+    for(uint8_t c = 0; c < SLAB_CLASS_COUNT; ++c){
+        lock_slab_class(c);
+        if(slab_classes[c].count > 0)
+            print_buffered(&pb," -> %lu[%u|%u|%u]",size_classes[c],slab_classes[c].used,slab_classes[c].count,free_stacks[c].head.count);
+        unlock_slab_class(c);
+    }
+    print_flush(&pb);
+    printf(" }\n");
+#ifdef CPU_CACHE
+    printf("cpu caches {");
+    for(uint8_t c = 0; cpu_caches != null && c < CACHE_CLASS_COUNT; ++c){
+        uint32_t n = 0;
+        for(uint32_t i = 0; i < cpu_count; ++i)
+            n += cpu_caches[i].count[c];
+        if(n > 0)
+            printf(" -> %lu[%u]",size_classes[c],n);
+    }
+    printf(" }\n");
+#else
+    printf("thread cache {");
+    for(uint8_t c = 0; c < CACHE_CLASS_COUNT; ++c){
+        if(tcache.count[c] > 0)
+            printf(" -> %lu[%u]",size_classes[c],tcache.count[c]);
+    }
+    printf(" }\n");
+#endif
+#ifdef LOCK_STATS
+    // counters are read without locks so they are only approximate
+    printf("locks {");
+    print_lock_stats("global",&glob_lock,1);
+    print_lock_stats("freelists",freelist_locks,freelist_count);
+    print_lock_stats("slabs",slab_locks,SLAB_CLASS_COUNT);
+    print_lock_stats("slab pool",&slab_pool_lock,1);
+    print_lock_stats("mmap",&mmap_lock,1);
+    printf(" }\n");
+#endif
+#ifdef HEAP_HUGEPAGE
+    printf("huge pages %lu mb\n",huge_size()/(1024*1024));
+#endif
 }
@@ -0,0 +1,517 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Dmitry "troydm" Geurkov (d.geurkov@gmail.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/*
+two level segregated fit (TLSF) malloc implementation
+
+free blocks are kept in FL_INDEX_COUNT*SL_INDEX_COUNT segregated lists,
+first level splits sizes by power of 2 and second level splits every power
+of 2 range into SL_INDEX_COUNT equal parts. two bitmaps tell which lists are
+non empty so both lookup and insertion are O(1).
+
+every block has the usual size_t header, lower bits of the size are used as
+flags telling if block itself and its left neighbour are free. free blocks
+additionally keep their size in the last size_t of the block (footer) so that
+left neighbour can be found and merged in O(1) on free.
+*/
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <mymalloc.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <linux/mman.h>
+
+// for code clarity for pointers we use null instead of 0
+#define null 0
+
+// initial values
+#define PAGE_SIZE (sysconf(_SC_PAGESIZE))
+#define MIN_BLOCK_SIZE 32 // bytes
+#define ALLOC_SIZE 33554432 // 32 MiB or 8192 pages if page size is 4096
+#define GIVE_BACK_SIZE 33554432 // 32 MiB or 8192 pages if page size is 4096
+#define MMAP_SIZE 1048576 // 1 MiB or 1024 pages if page size is 4096
+
+// tlsf parameters
+#define SL_INDEX_COUNT_LOG2 4 // 16 second level lists for each power of 2
+#define ALIGN_SIZE_LOG2 4 // blocks are 16 byte aligned
+#define SL_INDEX_COUNT (1 << SL_INDEX_COUNT_LOG2)
+#define ALIGN_SIZE (1 << ALIGN_SIZE_LOG2)
+#define FL_INDEX_SHIFT (SL_INDEX_COUNT_LOG2 + ALIGN_SIZE_LOG2)
+#define FL_INDEX_COUNT (64 - FL_INDEX_SHIFT + 1)
+#define SMALL_BLOCK_SIZE (1 << FL_INDEX_SHIFT) // blocks smaller than this are all in first level 0
+
+// memory block structure
+typedef struct memory_block_t {
+    size_t size;
+    struct memory_block_t* prev;
+    struct memory_block_t* next;
+} memory_block;
+
+// block flags kept in lower bits of size
+#define BLOCK_FREE 1 // block is free
+#define BLOCK_PREV_FREE 2 // left adjacent block is free
+#define BLOCK_FLAGS (BLOCK_FREE|BLOCK_PREV_FREE)
+
+// segregated free lists and their bitmaps
+static memory_block* freelists[FL_INDEX_COUNT][SL_INDEX_COUNT];
+static uint64_t fl_bitmap;
+static uint32_t sl_bitmap[FL_INDEX_COUNT];
+
+// heap
+// last size_t of the heap is a fence block header of size 0 that is never free
+// so the right adjacent block of any heap block is always a valid block header
+static memory_block* heap_start = null;
+static memory_block* heap_end = null;
+static size_t heap_size;
+static size_t mmap_size;
+
+// mmap
+#define is_mmap_block(b) (!(heap_start <= b && b < heap_end))
+
+// locking
+volatile bool locked = 0;
+
+static inline void spinlock(){
+    if (!__sync_bool_compare_and_swap(&locked, 0, 1)){
+        int i = 0;
+        do {
+            if (__sync_bool_compare_and_swap(&locked, 0, 1))
+                break;
+            else{
+                if(i == 10){
+                    i = 0;
+                    sched_yield();
+                }else
+                    ++i;
+            }
+        } while (1);
+    }
+}
+
+#define lock spinlock();
+
+#define unlock \
+    __asm__ __volatile__ ("" ::: "memory"); \
+    locked = 0;
+
+// useful macros
+#define byte_ptr(p) ((uint8_t*)p)
+#define shift_ptr(p,s) (byte_ptr(p) s)
+#define shift_block_ptr(b,s) ((memory_block*)(shift_ptr(b,s)))
+#define block_data(b) (shift_ptr(b,+sizeof(size_t)))
+#define data_block(p) (shift_block_ptr(p,-sizeof(size_t)))
+#define block_size(b) (b->size & ~BLOCK_FLAGS)
+#define block_end(b) (shift_block_ptr(b,+block_size(b)))
+#define block_footer(b) (*((size_t*)shift_ptr(b,+block_size(b)-sizeof(size_t))))
+#define block_left(b) (shift_block_ptr(b,-*((size_t*)shift_ptr(b,-sizeof(size_t)))))
+#define heap_fence (shift_block_ptr(heap_end,-sizeof(size_t)))
+#define align_size(s) (((s)+(ALIGN_SIZE-1)) & ~((size_t)ALIGN_SIZE-1))
+
+// print block information to stdout
+// for debug use only
+static inline void print_block(memory_block* b){
+    printf("block %p size %ld prev %p next %p\n",b,b->size,b->prev,b->next);
+}
+
+// find last set bit
+static inline int fls_size(size_t s){
+    return 63 - __builtin_clzl(s);
+}
+
+// find lists indexes to which block of size s belongs
+static inline void mapping_insert(size_t s, int* fl, int* sl){
+    if(s < SMALL_BLOCK_SIZE){
+        *fl = 0;
+        *sl = s / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+    }else{
+        int f = fls_size(s);
+        *sl = (s >> (f - SL_INDEX_COUNT_LOG2)) ^ SL_INDEX_COUNT;
+        *fl = f - (FL_INDEX_SHIFT - 1);
+    }
+}
+
+// find lists indexes from which any block is suitable for size s
+// size is rounded up to the next list so we never need to walk the list
+static inline void mapping_search(size_t s, int* fl, int* sl){
+    if(s >= SMALL_BLOCK_SIZE)
+        s += (1UL << (fls_size(s) - SL_INDEX_COUNT_LOG2)) - 1;
+    mapping_insert(s,fl,sl);
+}
+
+// insert free block into its segregated list
+static inline void insert_block(memory_block* b){
+    int fl, sl;
+    mapping_insert(block_size(b),&fl,&sl);
+    memory_block* h = freelists[fl][sl];
+    b->prev = null;
+    b->next = h;
+    if(h != null)
+        h->prev = b;
+    freelists[fl][sl] = b;
+    fl_bitmap |= 1UL << fl;
+    sl_bitmap[fl] |= 1U << sl;
+}
+
+// remove free block from its segregated list
+static inline void remove_block(memory_block* b){
+    int fl, sl;
+    mapping_insert(block_size(b),&fl,&sl);
+    if(b->prev != null)
+        b->prev->next = b->next;
+    else
+        freelists[fl][sl] = b->next;
+    if(b->next != null)
+        b->next->prev = b->prev;
+    if(freelists[fl][sl] == null){
+        sl_bitmap[fl] &= ~(1U << sl);
+        if(sl_bitmap[fl] == 0)
+            fl_bitmap &= ~(1UL << fl);
+    }
+}
+
+// mark block as free and let right adjacent block know about it
+static inline void mark_block_free(memory_block* b){
+    b->size |= BLOCK_FREE;
+    block_footer(b) = block_size(b);
+    block_end(b)->size |= BLOCK_PREV_FREE;
+}
+
+// mark block as used and let right adjacent block know about it
+static inline void mark_block_used(memory_block* b){
+    b->size &= ~BLOCK_FREE;
+    block_end(b)->size &= ~BLOCK_PREV_FREE;
+}
+
+// merge free block with its free adjacent blocks
+// merged adjacent blocks are removed from free lists
+static inline memory_block* merge_block(memory_block* b){
+    if(b->size & BLOCK_PREV_FREE){
+        memory_block* lb = block_left(b);
+        remove_block(lb);
+        lb->size += block_size(b);
+        b = lb;
+    }
+    memory_block* rb = block_end(b);
+    if(rb->size & BLOCK_FREE){
+        remove_block(rb);
+        b->size += block_size(rb);
+    }
+    return b;
+}
+
+// add block to free lists merging it with adjacent free blocks
+static inline memory_block* add_block(memory_block* b){
+    b = merge_block(b);
+    mark_block_free(b);
+    insert_block(b);
+    return b;
+}
+
+// split used memory block into 2 pieces one of size s and the other is remainder
+// remainder is added to free lists, if it is less than MIN_BLOCK_SIZE we just keep whole block
+static inline void split_memory_block(memory_block* b, size_t s){
+    size_t remainder = block_size(b) - s;
+    if(remainder >= MIN_BLOCK_SIZE){
+        memory_block* nb = shift_block_ptr(b,+s);
+        b->size = s | (b->size & BLOCK_FLAGS);
+        nb->size = remainder;
+        add_block(nb);
+    }
+}
+
+// find free block suitable for size s and remove it from free lists
+static inline memory_block* find_suitable_block(size_t s){
+    int fl, sl;
+    mapping_search(s,&fl,&sl);
+    if(fl >= FL_INDEX_COUNT)
+        return null;
+
+    uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+    if(sl_map == 0){
+        // no suitable lists in this first level, look for any larger one
+        if(fl+1 >= FL_INDEX_COUNT)
+            return null;
+        uint64_t fl_map = fl_bitmap & (~0UL << (fl+1));
+        if(fl_map == 0)
+            return null;
+        fl = __builtin_ctzl(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+
+    memory_block* b = freelists[fl][sl];
+    remove_block(b);
+    mark_block_used(b);
+    split_memory_block(b,s);
+    return b;
+}
+
+// grow heap using sbrk so that it has free block of at least size s
+static inline bool grow_heap(size_t s){
+    size_t pages_size = ((s/PAGE_SIZE)+1)*PAGE_SIZE;
+    if(pages_size < ALLOC_SIZE)
+        pages_size = ALLOC_SIZE;
+
+    memory_block* block;
+    if(heap_end == null){
+        // align program break so that block data is ALIGN_SIZE aligned
+        intptr_t pad = (-(intptr_t)sbrk(0)) & (ALIGN_SIZE-1);
+        if(pad > 0 && sbrk(pad) == (void*)-1)
+            return false;
+        void* p = sbrk(pages_size);
+        if(p == (void*)-1)
+            return false;
+        // first size_t is left unused so that block data is aligned
+        heap_start = (memory_block*)p;
+        heap_end = shift_block_ptr(p,+pages_size);
+        block = shift_block_ptr(p,+sizeof(size_t));
+        block->size = pages_size - 2*sizeof(size_t);
+    }else{
+        void* p = sbrk(pages_size);
+        if(p == (void*)-1)
+            return false;
+        if(p != heap_end){
+            // somebody else moved program break, heap can't be contiguous anymore
+            sbrk(-pages_size);
+            return false;
+        }
+        // old fence becomes header of the new block
+        block = heap_fence;
+        block->size = pages_size | (block->size & BLOCK_PREV_FREE);
+        heap_end = shift_block_ptr(heap_end,+pages_size);
+    }
+    heap_size += pages_size;
+    heap_fence->size = 0;
+    add_block(block);
+    return true;
+}
+
+// give free block at the end of the heap back to the operating system
+static inline void shrink_heap(memory_block* b){
+    intptr_t inc = block_size(b);
+    if(block_end(b) != heap_fence || inc < GIVE_BACK_SIZE)
+        return;
+    if(b == shift_block_ptr(heap_start,+sizeof(size_t))){
+        // keep GIVE_BACK_SIZE of the only heap block
+        inc -= GIVE_BACK_SIZE;
+        if(inc <= 0)
+            return;
+        remove_block(b);
+        b->size = GIVE_BACK_SIZE | (b->size & BLOCK_FLAGS);
+        sbrk(-inc);
+        heap_size -= inc;
+        heap_end = shift_block_ptr(heap_end,-inc);
+        heap_fence->size = 0;
+        mark_block_free(b);
+        insert_block(b);
+    }else{
+        // block header becomes new fence
+        remove_block(b);
+        sbrk(-inc);
+        heap_size -= inc;
+        heap_end = shift_block_ptr(heap_end,-inc);
+        heap_fence->size = 0;
+    }
+}
+
+void* malloc(size_t s){
+    // check for 0 size
+    if(s == 0)
+        return null;
+    // add size of size_t as we need to save size of memory block
+    s += sizeof(size_t);
+    size_t ns = align_size(s);
+    if(ns < MIN_BLOCK_SIZE)
+        ns = MIN_BLOCK_SIZE;
+
+    // if size is greater than or equals MMAP_SIZE we are going to use mmap
+    if(ns >= MMAP_SIZE){
+        void* m = mmap(NULL,s,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+        if(m == MAP_FAILED)
+            return null;
+        memory_block* b = (memory_block*)m;
+        b->size = s;
+        lock
+        mmap_size += s;
+        unlock
+        return block_data(b);
+    }
+
+    lock
+    memory_block* block = find_suitable_block(ns);
+    if(block == null){
+        // no free memory blocks found
+        // we need to grow heap, mapping_search rounds size up so add some room for it
+        if(grow_heap(ns + (ns >> SL_INDEX_COUNT_LOG2)))
+            block = find_suitable_block(ns);
+    }
+    unlock
+
+    if(block == null)
+        return null;
+    // shift pointer into data block pointer
+    return block_data(block);
+}
+
+void* realloc(void* p, size_t s){
+    if(p == null){
+        return malloc(s);
+    }else if(s == 0){
+        free(p);
+        return null;
+    }
+
+    // shift pointer back into memory block pointer
+    memory_block* b = data_block(p);
+
+    // find out which new size we need
+    size_t ss = s + sizeof(size_t);
+    size_t ns = align_size(ss);
+    if(ns < MIN_BLOCK_SIZE)
+        ns = MIN_BLOCK_SIZE;
+
+    // if memory is mmap we need to use mremap
+    lock
+    if(is_mmap_block(b)){
+        mmap_size -= b->size;
+        mmap_size += ss;
+        unlock
+        void* p = mremap(b,b->size,ss,MREMAP_MAYMOVE);
+        if(p == MAP_FAILED)
+            return null;
+        b = (memory_block*)p;
+        b->size = ss;
+        return block_data(b);
+    }
+
+    size_t bs = block_size(b);
+    if(ns < MMAP_SIZE){
+        // check if size is already sufficient, if so give back the tail
+        if(bs >= ns){
+            split_memory_block(b,ns);
+            unlock
+            return p;
+        }
+
+        // try merging with right adjacent free block
+        memory_block* rb = block_end(b);
+        if((rb->size & BLOCK_FREE) && bs + block_size(rb) >= ns){
+            remove_block(rb);
+            b->size += block_size(rb);
+            mark_block_used(b);
+            split_memory_block(b,ns);
+            unlock
+            return p;
+        }
+    }
+    unlock
+
+    void* np = malloc(s);
+    if(np != null){
+        // copy old data block into new one
+        bs -= sizeof(size_t);
+        memcpy(np,p,s > bs ? bs : s);
+
+        // free old data block
+        free(p);
+
+        // return newly allocated block
+        return np;
+    }
+
+    return null;
+}
+
+void free(void* p){
+    // check for null pointer
+    if(p == null)
+        return;
+
+    // shift pointer back into memory block pointer
+    memory_block* b = data_block(p);
+
+    lock
+    if(is_mmap_block(b)){
+        mmap_size -= b->size;
+        unlock
+        munmap(b,b->size);
+        return;
+    }
+
+    // add removed block into free lists
+    b = add_block(b);
+
+    // give last memory block that isn't needed back to the operating system
+    shrink_heap(b);
+    unlock
+}
+
+void* calloc(size_t nmemb, size_t size){
+    size = nmemb*size;
+    void* p = malloc(size);
+    if(p != null)
+        memset(p,0,size);
+    return p;
+}
+
+void print_block_info(void* p){
+    // shift pointer back into memory block pointer
+    memory_block* b = data_block(p);
+    lock
+    print_block(b);
+    unlock
+}
+
+void print_freelist(){
+    // header is printed before locking as first printf may need to malloc stdout buffer
+    printf("[heap size %lu mb mmap_size %lu mb, ",(heap_size/(1024*1024)),(mmap_size/(1024*1024)));
+    printf("freelist {");
+    lock
+    for(int fl = 0; fl < FL_INDEX_COUNT; ++fl){
+        if(!(fl_bitmap & (1UL << fl)))
+            continue;
+        for(int sl = 0; sl < SL_INDEX_COUNT; ++sl){
+            memory_block* b = freelists[fl][sl];
+            while(b != null){
+                printf(" -> %p[%lu|%p|%p]",b,block_size(b),b->prev,b->next);
+                // detect infinite loop if any
+                if(b == b->next){
+                    printf(" -> infinite loop\n");
+                    break;
+                }
+                b = b->next;
+            }
+        }
+    }
+    unlock
+    printf(" }\n");
+}